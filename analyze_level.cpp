@@ -0,0 +1,158 @@
+// Offline level analyzer: whether a level can be traversed and the fewest jumps it takes (see analyze.sh)
+// Usage: analyze_level [-j jump_sectors] level.dat...
+// Exits with 1 if a level can't be loaded or traversed
+//
+// Movement model, one step per sector:
+// - walk to the next sector, on the same plane or one of its neighbours; stepping over the edge of a floor
+//   goes onto the next floor (the ring rotates under the player)
+// - jump over jump_sectors sectors and land on the same plane, this is the only move that costs a jump
+// The player must land on a present tile; planes are mapped by position across segments with different geometry
+
+#include "run.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+static constexpr uint32_t cUnreached = UINT32_MAX;
+
+struct Analysis {
+    bool loaded = false;
+    uint32_t sectors = 0;
+    uint32_t jumps = cUnreached; // Fewest jumps to the end of the level, cUnreached if it can't be traversed
+    uint32_t furthest = 0; // Last sector the player can stand on
+};
+
+// Index of the segment containing the sector, hint is checked first
+static uint32_t SegmentOf(LevelInfo const& level, uint32_t sector, uint32_t hint) {
+    if (level.sector_offsets[hint] <= sector and sector < level.sector_offsets[hint + 1])
+        return hint;
+    return FindSegment(level, sector);
+}
+
+// Slots are floor-major and the right corner of a floor is the left corner of the next one,
+// so the neighbouring planes are the neighbouring slots of the ring
+static uint32_t SideSlot(SegmentGeometry const& geo, uint32_t slot, bool right) {
+    uint32_t const ring = geo.floors * geo.floor_planes;
+    return (slot + (right ? 1 : ring - 1)) % ring;
+}
+
+// Slot of the other geometry whose plane contains the middle of the slot's plane, floors as in IsTilePresent
+static uint32_t MapSlot(SegmentGeometry const& from, SegmentGeometry const& to, uint32_t slot) {
+    if (from.floors == to.floors and from.floor_planes == to.floor_planes)
+        return slot;
+    uint32_t const floor = slot / from.floor_planes % to.floors, plane = slot % from.floor_planes;
+    return floor * to.floor_planes + (2 * plane + 1) * to.floor_planes / (2 * from.floor_planes);
+}
+
+// Sweep over the sectors, keeping the fewest jumps to stand on each slot of the next jump + 1 sectors
+// Every move goes forward, so each sector is final once the previous ones are processed
+static void AnalyzeLevel(LevelInfo const& level, uint32_t jump, Analysis& analysis) {
+    uint32_t const total = level.sector_offsets.back();
+    uint32_t const rows = jump + 2;
+    size_t ring_max = 0;
+    for (auto const& seg : level.segments)
+        ring_max = std::max<size_t>(ring_max, seg->grid.Ring());
+    std::vector<uint32_t> dist(rows * ring_max, cUnreached);
+    auto const row = [&](uint32_t sector) { return dist.data() + sector % rows * ring_max; };
+
+    uint32_t land_hint = 0;
+    auto const relax = [&](uint32_t sector, SegmentGeometry const& from, uint32_t slot, uint32_t jumps) {
+        if (sector >= total) {
+            analysis.jumps = std::min(analysis.jumps, jumps);
+            return;
+        }
+        land_hint = SegmentOf(level, sector, land_hint);
+        GeometrySegment const& seg = *level.segments[land_hint];
+        if (!seg.geo.floors)
+            return;
+        uint32_t const to = MapSlot(from, seg.geo, slot);
+        if (!seg.grid.Present(size_t(sector - level.sector_offsets[land_hint]) * seg.grid.Ring() + to))
+            return;
+        uint32_t& d = row(sector)[to];
+        d = std::min(d, jumps);
+    };
+
+    // The player starts in the middle of the bottom floor, as in IsPlayerSupported
+    SegmentGeometry const& first = level.segments[FindSegment(level, 0)]->geo;
+    if (total and first.floors) {
+        uint32_t const planes = first.floor_planes;
+        relax(0, first, planes / 2, 0);
+        if (planes % 2 == 0)
+            relax(0, first, planes / 2 - 1, 0);
+    }
+
+    uint32_t segment = 0;
+    for (uint32_t sector = 0; sector < total; ++sector) {
+        uint32_t* const cur = row(sector);
+        segment = SegmentOf(level, sector, segment);
+        SegmentGeometry const& geo = level.segments[segment]->geo;
+        for (uint32_t slot = 0, ring = geo.floors * geo.floor_planes; slot != ring; ++slot) {
+            uint32_t const d = cur[slot];
+            if (d == cUnreached)
+                continue;
+            analysis.furthest = sector;
+            relax(sector + 1, geo, slot, d);
+            relax(sector + 1, geo, SideSlot(geo, slot, false), d);
+            relax(sector + 1, geo, SideSlot(geo, slot, true), d);
+            relax(sector + jump + 1, geo, slot, d + 1);
+        }
+        std::fill_n(cur, ring_max, cUnreached);
+        // Nothing in flight can land anymore
+        if (sector > analysis.furthest + jump)
+            break;
+    }
+}
+
+static Analysis AnalyzeLevelFile(char const* fname, uint32_t jump) {
+    Analysis analysis;
+    LevelInfo level;
+    if (!ReadLevelFromFile(level, fname))
+        return analysis;
+    analysis.loaded = true;
+    analysis.sectors = level.sector_offsets.back();
+    AnalyzeLevel(level, jump, analysis);
+    return analysis;
+}
+
+int main(int argc, char** argv) {
+    uint32_t jump = 4;
+    std::vector<char const*> files;
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "-j") and i + 1 < argc)
+            jump = std::atoi(argv[++i]);
+        else
+            files.push_back(argv[i]);
+    }
+    if (files.empty()) {
+        std::fprintf(stderr, "Usage: %s [-j jump_sectors] level.dat...\n", argv[0]);
+        return 2;
+    }
+
+    // Each level is a single sweep, the levels are spread over the threads
+    std::vector<Analysis> results(files.size());
+    auto const start = std::chrono::steady_clock::now();
+    ParallelFor(files.size(), [&](size_t idx) { results[idx] = AnalyzeLevelFile(files[idx], jump); });
+    double const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    size_t failed = 0;
+    for (size_t idx = 0; idx != files.size(); ++idx) {
+        Analysis const& analysis = results[idx];
+        if (!analysis.loaded) {
+            // The reason was printed by ReadLevelFromFile
+            std::printf("%s: not loaded\n", files[idx]);
+            ++failed;
+        } else if (analysis.jumps != cUnreached) {
+            std::printf("%s: traversable, %u sectors, %u jumps\n", files[idx], analysis.sectors, analysis.jumps);
+        } else {
+            std::printf("%s: not traversable, %u sectors, stuck at sector %u\n", files[idx], analysis.sectors, analysis.furthest);
+            ++failed;
+        }
+    }
+    std::printf("%zu levels, %zu failed in %.3f s (%zu threads)\n", files.size(), failed, seconds, WorkerCount());
+    return failed ? 1 : 0;
+}
@@ -1,6 +1,6 @@
 #version 150 core
 
-in vec3 vfColor;
+flat in vec3 vfColor;
 
 out vec4 fColor;
 
@@ -2,13 +2,19 @@
 
 in vec3 vPos;
 in vec3 vColor;
+// Packed level vertices only (RUN_PACKED_VERTICES), 0 otherwise
+in float vSector;
+in float vPaletteIndex;
 
-out vec3 vfColor;
+flat out vec3 vfColor;
 
 // Scale to perform before displacement
 uniform vec3 uScale;
 // The displacement of objects
 uniform vec3 uDisplacement;
+// Take the color from the palette instead of vColor
+uniform bool uUsePalette;
+uniform vec3 uPalette[4];
 
 /*
 perspective projection matrix
@@ -46,10 +52,11 @@ const mat4 proj = mat4(
 
 void main() {
     vec3 pos = vPos;
+    pos.z -= vSector;
     // Scale
     pos *= uScale;
     // Then displace
     pos += uDisplacement;
-    vfColor = vColor;
+    vfColor = uUsePalette ? uPalette[int(vPaletteIndex)] : vColor;
     gl_Position = proj * vec4(pos, 1.0);
 }
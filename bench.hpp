@@ -0,0 +1,20 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+
+// Helpers shared by the headless benchmarks (see bench.sh)
+
+using BenchClock = std::chrono::steady_clock;
+
+// Runs fn reps times and returns the time of the fastest run in seconds
+template <typename F>
+double BestOf(int reps, F&& fn) {
+    double best = 1e30;
+    for (int rep = 0; rep != reps; ++rep) {
+        auto const start = BenchClock::now();
+        fn();
+        best = std::min(best, std::chrono::duration<double>(BenchClock::now() - start).count());
+    }
+    return best;
+}
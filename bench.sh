@@ -0,0 +1,24 @@
+#!/bin/sh
+set -e
+
+# Headless benchmarks, no window or GL context needed
+
+c++ -std=c++20 -O2 -o bench_bitops bench_bitops.cpp bitops.cpp
+./bench_bitops
+
+# Links the level code, so GLEW is needed like in compile.sh (no GL calls are made)
+if [ ! -f glew.o ]; then
+    echo 'Compiling GLEW'
+    cc -c -o glew.o -I "$GLEW_PATH/include" "$GLEW_PATH/src/glew.c" -DGLEW_STATIC
+fi
+MESH_DEFS=
+if [ "${VERTEX_FORMAT-float}" = packed ]; then
+    MESH_DEFS=-DRUN_PACKED_VERTICES
+fi
+LEVEL_SRCS='run.cpp render_mesh.cpp util.cpp tile_grid.cpp bitops.cpp thread_pool.cpp profiler.cpp'
+c++ -DGLEW_STATIC $MESH_DEFS -std=c++20 -O2 -pthread -o bench_mesh glew.o bench_mesh.cpp $LEVEL_SRCS -lGL
+./bench_mesh
+
+# GL calls are stubbed, the level size and densities can be passed in BENCH_LEVEL_ARGS (see bench_level.cpp)
+c++ -DGLEW_STATIC $MESH_DEFS -std=c++20 -O2 -pthread -o bench_level glew.o bench_level.cpp $LEVEL_SRCS -lGL
+./bench_level $BENCH_LEVEL_ARGS
@@ -0,0 +1,54 @@
+// Micro-benchmark of the bitarray pack/unpack kernels (see bench.sh)
+
+#include "bitops.hpp"
+#include "bench.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+// The per-bit loops the level file code used before the kernels, as a baseline
+static void PackBitsPerBit(uint8_t const* bytes, size_t count, uint8_t* bits) {
+    std::memset(bits, 0, (count + 7) / 8);
+    for (size_t s = 0; s < count; ++s)
+        bits[s / 8] |= static_cast<bool>(bytes[s] & 1) << (s & 7);
+}
+
+static void UnpackBitsPerBit(uint8_t const* bits, size_t count, uint8_t* bytes) {
+    for (size_t s = 0; s < count; ++s)
+        bytes[s] = (bits[s / 8] >> (s & 7)) & 1;
+}
+
+int main() {
+    std::vector<BitKernels> all {{"perbit", PackBitsPerBit, UnpackBitsPerBit}};
+    for (auto const& kernels : GetBitKernels())
+        all.push_back(kernels);
+
+    std::mt19937 rng(1);
+    for (size_t const num_slots : {size_t(1) << 20, size_t(1) << 24, size_t(3000017)}) {
+        std::vector<uint8_t> bytes(num_slots), unpacked(num_slots);
+        std::vector<uint8_t> bits((num_slots + 7) / 8), reference(bits.size());
+        for (auto& b : bytes)
+            b = rng() & 3; // Selection bits must be ignored
+        PackBitsPerBit(bytes.data(), num_slots, reference.data());
+
+        std::printf("%zu slots:\n", num_slots);
+        for (auto const& kernels : all) {
+            double const pack = BestOf(10, [&] { kernels.pack(bytes.data(), num_slots, bits.data()); });
+            double const unpack = BestOf(10, [&] { kernels.unpack(bits.data(), num_slots, unpacked.data()); });
+
+            bool ok = bits == reference;
+            for (size_t s = 0; s != num_slots; ++s)
+                ok = ok and unpacked[s] == (bytes[s] & 1);
+            // Throughput is counted in slot bytes
+            std::printf("  %-6s pack %7.3f ms (%8.1f MB/s, %.3f ns/slot)  unpack %7.3f ms (%8.1f MB/s, %.3f ns/slot)%s\n",
+                kernels.name,
+                pack * 1e3, num_slots / pack / 1e6, pack * 1e9 / num_slots,
+                unpack * 1e3, num_slots / unpack / 1e6, unpack * 1e9 / num_slots,
+                ok ? "" : "  MISMATCH");
+            if (!ok)
+                return 1;
+        }
+    }
+}
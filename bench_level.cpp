@@ -0,0 +1,162 @@
+// Benchmark of level model generation, DumpLevelToFile and LoadLevelFromFile on synthetic levels (see bench.sh)
+// Usage: bench_level [segments [sectors [density...]]]
+
+#include "render.hpp"
+#include "bench.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <vector>
+
+// Heap allocations, counted on all threads
+static std::atomic<size_t> sAllocCount = 0;
+static std::atomic<size_t> sAllocBytes = 0;
+
+void* operator new(size_t size) {
+    sAllocCount.fetch_add(1, std::memory_order_relaxed);
+    sAllocBytes.fetch_add(size, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+// The deletes get inlined into callers that allocated with new, where GCC can't tell that this new used malloc
+#if defined(__GNUC__) and !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    std::free(ptr);
+}
+#if defined(__GNUC__) and !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+// Bytes passed to glBufferData/glBufferSubData
+static size_t sUploadBytes = 0;
+
+// The level code only calls GL through GLEW's function pointers, which stay null without a context
+// Replace them with stubs, so the CPU side can be measured without a window
+static void StubGL() {
+    __glewGenVertexArrays = [](GLsizei n, GLuint* names) { std::fill_n(names, n, 1); };
+    __glewGenBuffers = [](GLsizei n, GLuint* names) { std::fill_n(names, n, 1); };
+    __glewDeleteVertexArrays = [](GLsizei, GLuint const*) {};
+    __glewDeleteBuffers = [](GLsizei, GLuint const*) {};
+    __glewBindVertexArray = [](GLuint) {};
+    __glewBindBuffer = [](GLenum, GLuint) {};
+    __glewVertexAttribPointer = [](GLuint, GLint, GLenum, GLboolean, GLsizei, void const*) {};
+    __glewEnableVertexAttribArray = [](GLuint) {};
+    // Buffer storage allocated without data (mesh arena growth) isn't an upload
+    __glewBufferData = [](GLenum, GLsizeiptr size, void const* data, GLenum) { sUploadBytes += data ? size : 0; };
+    __glewBufferSubData = [](GLenum, GLintptr, GLsizeiptr size, void const*) { sUploadBytes += size; };
+    __glewCopyBufferSubData = [](GLenum, GLenum, GLintptr, GLintptr, GLsizeiptr) {};
+}
+
+// Segments cycle through a few shapes, each slot is present with the given probability
+static LevelInfo MakeSyntheticLevel(uint32_t segments, uint32_t sectors, double density) {
+    static constexpr std::array<std::array<uint32_t, 2>, 4> cShapes = {{{4, 5}, {6, 4}, {3, 3}, {8, 6}}};
+    std::mt19937 rng(1);
+    std::bernoulli_distribution present(density);
+    LevelInfo level;
+    std::vector<uint8_t> values;
+    for (uint32_t idx = 0; idx != segments; ++idx) {
+        auto& seg = *level.segments.emplace_back(new GeometrySegment);
+        seg.geo = {cShapes[idx % cShapes.size()][0], cShapes[idx % cShapes.size()][1], sectors};
+        values.resize(size_t(seg.geo.floors) * seg.geo.floor_planes * sectors);
+        for (auto& v : values)
+            v = present(rng);
+        seg.grid.AssignBytes(seg.geo.floors * seg.geo.floor_planes, sectors, values.data());
+        GetFloorProperties(seg);
+        SetupSegmentBuffers(seg);
+    }
+    UpdateSectorOffsets(level);
+    return level;
+}
+
+// Compared by level sector, the loaded level may be split into chunks differently
+static bool SameGrids(LevelInfo const& a, LevelInfo const& b) {
+    if (a.sector_offsets.back() != b.sector_offsets.back())
+        return false;
+    for (uint32_t sector = 0; sector != a.sector_offsets.back(); ++sector) {
+        uint32_t const ia = FindSegment(a, sector), ib = FindSegment(b, sector);
+        GeometrySegment const& sa = *a.segments[ia], & sb = *b.segments[ib];
+        if (sa.geo.floors != sb.geo.floors or sa.geo.floor_planes != sb.geo.floor_planes)
+            return false;
+        size_t const ring = sa.grid.Ring();
+        size_t const oa = (sector - a.sector_offsets[ia]) * ring, ob = (sector - b.sector_offsets[ib]) * ring;
+        for (size_t slot = 0; slot != ring; ++slot)
+            if (sa.grid.Present(oa + slot) != sb.grid.Present(ob + slot))
+                return false;
+    }
+    return true;
+}
+
+struct Measurement {
+    double seconds;
+    size_t allocs, alloc_bytes, upload_bytes;
+};
+
+template <typename F>
+static Measurement Measure(int reps, F&& fn) {
+    // One untimed run, so the counters cover a single steady state run
+    size_t const count = sAllocCount, bytes = sAllocBytes, upload = sUploadBytes;
+    fn();
+    Measurement m {0, sAllocCount - count, sAllocBytes - bytes, sUploadBytes - upload};
+    m.seconds = BestOf(reps, fn);
+    return m;
+}
+
+static void Report(char const* name, Measurement const& m, size_t tiles, size_t bytes, char const* bytes_name) {
+    std::printf("  %-8s %9.3f ms  %7.2f ns/tile  %8.1f MB/s %-6s  %7zu allocs (%.1f MB)\n",
+        name, m.seconds * 1e3, m.seconds * 1e9 / tiles, bytes / m.seconds / 1e6, bytes_name,
+        m.allocs, m.alloc_bytes / 1e6);
+}
+
+int main(int argc, char** argv) {
+    uint32_t const segments = argc > 1 ? std::atoi(argv[1]) : 64;
+    uint32_t const sectors = argc > 2 ? std::atoi(argv[2]) : 4000;
+    std::vector<double> densities;
+    for (int i = 3; i < argc; ++i)
+        densities.push_back(std::atof(argv[i]));
+    if (densities.empty())
+        densities = {0.05, 0.5, 0.95};
+    char const* const fname = "bench_level.dat";
+    StubGL();
+
+    for (double const density : densities) {
+        LevelInfo level = MakeSyntheticLevel(segments, sectors, density);
+        size_t tiles = 0;
+        for (auto const& seg : level.segments)
+            tiles += seg->grid.Size();
+        std::printf("%u segments x %u sectors, density %.2f (%zu tiles):\n", segments, sectors, density, tiles);
+
+        Measurement const gen = Measure(5, [&] {
+            for (auto& seg : level.segments)
+                GenerateLevelSceneModel(*seg);
+        });
+        Report("generate", gen, tiles, gen.upload_bytes, "mesh");
+
+        Measurement const dump = Measure(5, [&] { DumpLevelToFile(level, fname); });
+        std::FILE* file = std::fopen(fname, "rb");
+        std::fseek(file, 0, SEEK_END);
+        size_t const file_size = std::ftell(file);
+        std::fclose(file);
+        Report("dump", dump, tiles, file_size, "file");
+
+        LevelInfo loaded;
+        Measurement const load = Measure(5, [&] { LoadLevelFromFile(loaded, fname); });
+        Report("load", load, tiles, file_size, "file");
+        if (!SameGrids(level, loaded)) {
+            std::fprintf(stderr, "Loaded level differs from the dumped one\n");
+            return 1;
+        }
+    }
+    std::remove(fname);
+}
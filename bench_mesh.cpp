@@ -0,0 +1,29 @@
+// Benchmark of the CPU stage of the level model build (see bench.sh)
+
+#include "render.hpp"
+#include "bench.hpp"
+
+#include <cstdio>
+#include <random>
+#include <vector>
+
+int main() {
+    std::mt19937 rng(1);
+    // Segments are built a chunk at a time, the first one is the longest chunk
+    for (SegmentGeometry const geo : {SegmentGeometry{4, 5, cMaxChunkSectors}, SegmentGeometry{6, 4, 50000}, SegmentGeometry{16, 8, 10000}}) {
+        uint32_t const ring = geo.floors * geo.floor_planes;
+        size_t const num_slots = size_t(ring) * geo.sectors;
+        std::vector<uint8_t> values(num_slots);
+        for (auto& v : values)
+            v = rng() & 1;
+        TileGrid grid;
+        grid.AssignBytes(ring, geo.sectors, values.data());
+
+        SegmentMeshData mesh;
+        double const build = BestOf(10, [&] { BuildSegmentMesh(geo, grid, mesh); });
+        size_t const bytes = mesh.vertices.size() + mesh.indices.size();
+        std::printf("%2u floors x %u planes x %6u sectors: %7.3f ms per rebuild (%.2f ns/tile, %7.1f MB/s of mesh data)\n",
+            geo.floors, geo.floor_planes, geo.sectors,
+            build * 1e3, build * 1e9 / num_slots, bytes / build / 1e6);
+    }
+}
@@ -0,0 +1,132 @@
+#include "bitops.hpp"
+
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RUN_X86_KERNELS
+#endif
+
+// Scalar kernels, 8 slots per 64-bit word
+
+static void PackBitsScalar(uint8_t const* bytes, size_t count, uint8_t* bits) {
+    size_t const whole = count / 8;
+    for (size_t i = 0; i != whole; ++i) {
+        uint64_t x;
+        std::memcpy(&x, bytes + 8 * i, sizeof(x));
+        // Gathers bit 0 of byte k into bit k of the top byte
+        bits[i] = ((x & 0x0101010101010101) * 0x0102040810204080) >> 56;
+    }
+    if (count % 8) {
+        uint8_t last = 0;
+        for (size_t s = 8 * whole; s != count; ++s)
+            last |= (bytes[s] & 1) << (s & 7);
+        bits[whole] = last;
+    }
+}
+
+static void UnpackBitsScalar(uint8_t const* bits, size_t count, uint8_t* bytes) {
+    size_t const whole = count / 8;
+    for (size_t i = 0; i != whole; ++i) {
+        // Byte k keeps bit k, which is then moved to bit 7 by the carry and shifted down
+        uint64_t const y = (uint64_t(bits[i]) * 0x0101010101010101) & 0x8040201008040201;
+        uint64_t const x = ((y + 0x7F7F7F7F7F7F7F7F) >> 7) & 0x0101010101010101;
+        std::memcpy(bytes + 8 * i, &x, sizeof(x));
+    }
+    for (size_t s = 8 * whole; s != count; ++s)
+        bytes[s] = (bits[s / 8] >> (s & 7)) & 1;
+}
+
+#ifdef RUN_X86_KERNELS
+
+// SSE2 kernels, 16 slots per iteration
+
+__attribute__((target("sse2")))
+static void PackBitsSSE2(uint8_t const* bytes, size_t count, uint8_t* bits) {
+    size_t const whole = count / 16;
+    for (size_t i = 0; i != whole; ++i) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(bytes + 16 * i));
+        // Move bit 0 of each byte to bit 7, where movemask picks it up
+        uint16_t const mask = _mm_movemask_epi8(_mm_slli_epi16(v, 7));
+        std::memcpy(bits + 2 * i, &mask, sizeof(mask));
+    }
+    PackBitsScalar(bytes + 16 * whole, count - 16 * whole, bits + 2 * whole);
+}
+
+__attribute__((target("sse2")))
+static void UnpackBitsSSE2(uint8_t const* bits, size_t count, uint8_t* bytes) {
+    __m128i const select = _mm_set_epi8(
+        -128, 64, 32, 16, 8, 4, 2, 1,
+        -128, 64, 32, 16, 8, 4, 2, 1);
+    __m128i const one = _mm_set1_epi8(1);
+    size_t const whole = count / 16;
+    for (size_t i = 0; i != whole; ++i) {
+        // Bytes 0-7 get the first bit byte, bytes 8-15 the second one
+        __m128i v = _mm_unpacklo_epi64(_mm_set1_epi8(bits[2 * i]), _mm_set1_epi8(bits[2 * i + 1]));
+        v = _mm_cmpeq_epi8(_mm_and_si128(v, select), select);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(bytes + 16 * i), _mm_and_si128(v, one));
+    }
+    UnpackBitsScalar(bits + 2 * whole, count - 16 * whole, bytes + 16 * whole);
+}
+
+// AVX2 kernels, 32 slots per iteration
+
+__attribute__((target("avx2")))
+static void PackBitsAVX2(uint8_t const* bytes, size_t count, uint8_t* bits) {
+    size_t const whole = count / 32;
+    for (size_t i = 0; i != whole; ++i) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(bytes + 32 * i));
+        uint32_t const mask = _mm256_movemask_epi8(_mm256_slli_epi16(v, 7));
+        std::memcpy(bits + 4 * i, &mask, sizeof(mask));
+    }
+    PackBitsSSE2(bytes + 32 * whole, count - 32 * whole, bits + 4 * whole);
+}
+
+__attribute__((target("avx2")))
+static void UnpackBitsAVX2(uint8_t const* bits, size_t count, uint8_t* bytes) {
+    // Byte k of the result comes from bit byte k / 8 (shuffles stay within 128-bit lanes)
+    __m256i const spread = _mm256_set_epi8(
+        3, 3, 3, 3, 3, 3, 3, 3, 2, 2, 2, 2, 2, 2, 2, 2,
+        1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m256i const select = _mm256_set1_epi64x(static_cast<int64_t>(0x8040201008040201));
+    __m256i const one = _mm256_set1_epi8(1);
+    size_t const whole = count / 32;
+    for (size_t i = 0; i != whole; ++i) {
+        uint32_t word;
+        std::memcpy(&word, bits + 4 * i, sizeof(word));
+        __m256i v = _mm256_shuffle_epi8(_mm256_set1_epi32(word), spread);
+        v = _mm256_cmpeq_epi8(_mm256_and_si256(v, select), select);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(bytes + 32 * i), _mm256_and_si256(v, one));
+    }
+    UnpackBitsSSE2(bits + 4 * whole, count - 32 * whole, bytes + 32 * whole);
+}
+
+#endif
+
+static std::vector<BitKernels> DetectBitKernels() {
+    std::vector<BitKernels> kernels {{"scalar", PackBitsScalar, UnpackBitsScalar}};
+#ifdef RUN_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        kernels.push_back({"sse2", PackBitsSSE2, UnpackBitsSSE2});
+    if (__builtin_cpu_supports("avx2"))
+        kernels.push_back({"avx2", PackBitsAVX2, UnpackBitsAVX2});
+#endif
+    return kernels;
+}
+
+std::span<BitKernels const> GetBitKernels() {
+    static std::vector<BitKernels> const kernels = DetectBitKernels();
+    return kernels;
+}
+
+void PackBits(uint8_t const* bytes, size_t count, uint8_t* bits) {
+    static PackBitsFn const pack = GetBitKernels().back().pack;
+    pack(bytes, count, bits);
+}
+
+void UnpackBits(uint8_t const* bits, size_t count, uint8_t* bytes) {
+    static UnpackBitsFn const unpack = GetBitKernels().back().unpack;
+    unpack(bits, count, bytes);
+}
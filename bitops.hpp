@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <span>
+
+// Conversion between one byte per slot and packed bitarrays (LSB first, like the level file)
+
+// Packs bit 0 of count bytes into (count + 7) / 8 bytes, padding bits are 0
+using PackBitsFn = void (*)(uint8_t const* bytes, size_t count, uint8_t* bits);
+// Expands count bits into count bytes of 0 or 1
+using UnpackBitsFn = void (*)(uint8_t const* bits, size_t count, uint8_t* bytes);
+
+struct BitKernels {
+    char const* name;
+    PackBitsFn pack;
+    UnpackBitsFn unpack;
+};
+
+// Kernels supported by this CPU, the last one is the fastest
+std::span<BitKernels const> GetBitKernels();
+
+// Use the fastest kernels
+void PackBits(uint8_t const* bytes, size_t count, uint8_t* bits);
+void UnpackBits(uint8_t const* bits, size_t count, uint8_t* bytes);
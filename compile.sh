@@ -5,7 +5,10 @@ CC="${CC-cc}"
 CXX="${CXX-c++}"
 
 OBJS=()
+DEFS=()
 BACKEND="${BACKEND-sdl}"
+RENDERER="${RENDERER-mesh}"
+VERTEX_FORMAT="${VERTEX_FORMAT-float}"
 
 case "$BACKEND" in
     sdl)
@@ -29,8 +32,36 @@ case "$BACKEND" in
         ;;
 esac
 
+case "$RENDERER" in
+    mesh)
+        OBJS+=(render_mesh.cpp)
+        ;;
+    procedural)
+        OBJS+=(render_procedural.cpp)
+        ;;
+    instanced)
+        OBJS+=(render_instanced.cpp)
+        ;;
+    *)
+        echo "Unknown renderer: $RENDERER" >&2
+        exit 1;
+        ;;
+esac
+
+case "$VERTEX_FORMAT" in
+    float)
+        ;;
+    packed)
+        DEFS+=(-DRUN_PACKED_VERTICES)
+        ;;
+    *)
+        echo "Unknown vertex format: $VERTEX_FORMAT" >&2
+        exit 1;
+        ;;
+esac
+
 if [ ! -f glew.o ]; then
     echo 'Compiling GLEW'
     cc -c -o glew.o -I "$GLEW_PATH/include" "$GLEW_PATH/src/glew.c" -DGLEW_STATIC
 fi
-c++ -DGLEW_STATIC -std=c++20 -o run glew.o main.cpp util.cpp run.cpp -lGL "${OBJS[@]}"
+c++ -DGLEW_STATIC "${DEFS[@]}" -std=c++20 -pthread -o run glew.o main.cpp util.cpp run.cpp tile_grid.cpp bitops.cpp thread_pool.cpp profiler.cpp -lGL "${OBJS[@]}"
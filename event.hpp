@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <chrono>
 
 enum class EventType : uint32_t {
     Quit,
@@ -57,10 +58,21 @@ inline char const* PhysicalKeyAsString(PhysicalKey key) {
 #undef CASE
 #endif
 
+// Clock of the event times: steady_clock in nanoseconds
+inline int64_t EventTimeNow() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 union WinEvent {
     EventType type;
+    // Members of every event
+    struct {
+        EventType type;
+        int64_t time; // When the event happened (see EventTimeNow)
+    } common;
     struct {
         EventType type;
+        int64_t time;
         LogicalKey lkey;
         PhysicalKey pkey;
     } key;
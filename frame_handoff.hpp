@@ -0,0 +1,43 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Lock-free handoff of frame snapshots from the main thread to the render thread, one producer and one consumer
+// Each published snapshot is taken exactly once, so a snapshot can carry changes since the previous one
+// Neither side blocks: the main thread skips publishing while the last snapshot is still waiting,
+// and the render thread keeps drawing its current snapshot until a new one is published
+template <typename T>
+struct FrameHandoff {
+    T slots[2];
+    // 0 if the last published snapshot was taken, otherwise 1 + its slot
+    std::atomic<uint32_t> published = 0;
+    uint32_t back = 0; // Slot filled by the main thread
+    uint32_t front = 0; // Slot drawn by the render thread
+
+    // Main thread: whether the back slot can be filled and published (the render thread is done with it)
+    bool CanPublish() const { return published.load(std::memory_order_acquire) == 0; }
+    T& Back() { return slots[back]; }
+    // Main thread: hands the back slot over, only after CanPublish returned true
+    void Publish() {
+        published.store(1 + back, std::memory_order_release);
+        published.notify_one();
+        back ^= 1;
+    }
+
+    // Render thread: switches to the published snapshot if there is a new one
+    bool Take() {
+        uint32_t const slot = published.load(std::memory_order_acquire);
+        if (!slot)
+            return false;
+        front = slot - 1;
+        published.store(0, std::memory_order_release);
+        return true;
+    }
+    T& Front() { return slots[front]; }
+
+    // Render thread: blocks until the first snapshot is published
+    void WaitFirst() {
+        published.wait(0, std::memory_order_acquire);
+    }
+};
@@ -0,0 +1,59 @@
+#version 150 core
+
+// Instanced level model: a unit quad (vCorner) drawn once per slot of the whole level
+
+// Corner of the unit quad (plane, sector offset)
+in vec2 vCorner;
+// Per-instance: sector index in the segment
+in float vSector;
+// Per-instance: entry of the segment in uSegmentOffsets
+in uint vSegment;
+// Per-instance: floor, floor plane, number of floors, number of floor planes
+in uvec4 vTile;
+// Per-instance: index into uPalette, 0 is an empty slot
+in uint vColorIndex;
+
+flat out vec3 vfColor;
+
+// Scale to perform before displacement
+uniform vec3 uScale;
+// The displacement of objects
+uniform vec3 uDisplacement;
+uniform vec3 uPalette[4];
+// First level sector of each segment
+uniform usamplerBuffer uSegmentOffsets;
+
+// See basic.vs.glsl
+const float near = 0.1;
+const float far = 100.;
+
+const mat4 proj = mat4(
+    near, 0, 0, 0,
+    0, near, 0, 0,
+    0, 0, (-far - near)/(far - near), -1,
+    0, 0, (-1.4 * far * near)/(far - near), 0
+);
+
+const float PI = 3.14159265358979;
+
+void main() {
+    vfColor = uPalette[vColorIndex];
+    if (vColorIndex == 0u) {
+        // Empty slot, all vertices collapse into a single point
+        gl_Position = vec4(0., 0., 0., 1.);
+        return;
+    }
+
+    // First floor must be flat horizontal, so phase offset is phi/2
+    float phi = 2. * PI / float(vTile.z);
+    float angle = float(vTile.x) * phi;
+    vec2 left = vec2(sin(angle - phi/2.), -cos(angle - phi/2.));
+    vec2 right = vec2(sin(angle + phi/2.), -cos(angle + phi/2.));
+
+    vec3 pos = vec3(mix(left, right, (float(vTile.y) + vCorner.x) / float(vTile.w)), -(float(texelFetch(uSegmentOffsets, int(vSegment)).r) + vSector + vCorner.y));
+    // Scale
+    pos *= uScale;
+    // Then displace
+    pos += uDisplacement;
+    gl_Position = proj * vec4(pos, 1.0);
+}
@@ -0,0 +1,71 @@
+#version 150 core
+
+// Procedural level model: one instance per slot (uFirstSlot + gl_InstanceID), 6 vertices per tile (gl_VertexID)
+// The slot buffer holds the presence bitarray (same layout as in level files)
+
+flat out vec3 vfColor;
+
+uniform usamplerBuffer uSlots;
+// Slot of the first instance (first visible sector)
+uniform int uFirstSlot;
+// Number of floors and floor planes of the segment
+uniform ivec2 uGeometry;
+// Scale to perform before displacement
+uniform vec3 uScale;
+// The displacement of objects
+uniform vec3 uDisplacement;
+uniform vec3 uPalette[4];
+
+// See basic.vs.glsl
+const float near = 0.1;
+const float far = 100.;
+
+const mat4 proj = mat4(
+    near, 0, 0, 0,
+    0, near, 0, 0,
+    0, 0, (-far - near)/(far - near), -1,
+    0, 0, (-1.4 * far * near)/(far - near), 0
+);
+
+const float PI = 3.14159265358979;
+
+// Corner (plane, sector) offsets of the two triangles of a tile
+// Both end on the front-left corner (provoking vertex)
+const ivec2 corners[6] = ivec2[6](
+    ivec2(1, 0), ivec2(1, 1), ivec2(0, 0),
+    ivec2(1, 1), ivec2(0, 1), ivec2(0, 0)
+);
+
+uint slotBit(int slot) {
+    return (texelFetch(uSlots, slot >> 3).r >> uint(slot & 7)) & 1u;
+}
+
+void main() {
+    int slot = uFirstSlot + gl_InstanceID;
+    uint index = slotBit(slot);
+    vfColor = uPalette[index];
+    if (index == 0u) {
+        // Empty slot, all vertices collapse into a single point
+        gl_Position = vec4(0., 0., 0., 1.);
+        return;
+    }
+
+    int ring = uGeometry.x * uGeometry.y;
+    int sector = slot / ring;
+    int flr = (slot % ring) / uGeometry.y;
+    int plane = slot % uGeometry.y;
+    ivec2 corner = corners[gl_VertexID];
+
+    // First floor must be flat horizontal, so phase offset is phi/2
+    float phi = 2. * PI / float(uGeometry.x);
+    float angle = float(flr) * phi;
+    vec2 left = vec2(sin(angle - phi/2.), -cos(angle - phi/2.));
+    vec2 right = vec2(sin(angle + phi/2.), -cos(angle + phi/2.));
+
+    vec3 pos = vec3(mix(left, right, float(plane + corner.x) / float(uGeometry.y)), -float(sector + corner.y));
+    // Scale
+    pos *= uScale;
+    // Then displace
+    pos += uDisplacement;
+    gl_Position = proj * vec4(pos, 1.0);
+}
@@ -1,7 +1,14 @@
 #include <cstdio>
 #include <cstdint>
+#include <algorithm>
 #include <array>
 #include <cmath>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <span>
+#include <utility>
+#include <vector>
 
 #include <GL/glew.h>
 
@@ -9,6 +16,9 @@
 #include "type_util.hpp"
 #include "util.hpp"
 #include "run.hpp"
+#include "render.hpp"
+#include "profiler.hpp"
+#include "frame_handoff.hpp"
 #include "wnd.hpp"
 
 /*static Vtx sPolygonData[] = {
@@ -17,44 +27,14 @@
     {{-.5f, -.5f,  0.f}}
 };*/
 
-// Z scaling of the level model
-static float const sLevelZScale = 0.04f;
-
-uint32_t LoadShaderFromFile(char const* fname, GLenum type) {
-    auto src = ReadFile(fname, false);
-    uint32_t shader = glCreateShader(type);
-
-    char const* src_var = reinterpret_cast<char*>(src.data.get());
-    int32_t size = src.size;
-    glShaderSource(shader, 1, &src_var, &size);
-    glCompileShader(shader);
-
-    int32_t status;
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
-
-    if (!status) {
-        int32_t log_size;
-        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &log_size);
-
-        char* buf = reinterpret_cast<char*>(alloca(log_size));
-        glGetShaderInfoLog(shader, log_size, nullptr, buf);
-
-        std::printf("Error while compiling shader: %s\n", buf);
-    }
-
-    return shader;
-}
-
-struct BasicShader {
-    uint32_t prog;
-
-    int32_t loc_uScale;
-    int32_t loc_uDisplacement;
-};
-
+// Main thread: the level is edited and played here, the render thread draws a copy of it (see FrameSnapshot)
 struct CommonState {
     LevelInfo level;
-    BasicShader shader;
+    // Requests for the render thread, sent with the next snapshot
+    bool toggle_overlay = false;
+    bool print_mesh_stats = false;
+    // Times of the key presses handled since the last snapshot, for the input latency (see RecordInputLatency)
+    std::vector<int64_t> input_times;
 };
 
 enum class SegmentMode : uint8_t {
@@ -75,17 +55,53 @@ struct EditorState {
     uint32_t cur_segment, cur_sector, cur_spot;
     float curZ;
     SegmentMode segment_mode;
-    SegmentBufferMode segment_block_mode;
     MeshVisualMode segment_visual_mode;
-    uint32_t segment_block_buffer;
-    uint32_t segment_block_vao;
-    SegmentGeometry segment_block_geometry;
+    // Sectors of the current chunk were inserted or erased, the level layout is updated by CommitEdits
+    bool edits_pending;
 };
 
 struct PlayingState {
     CommonState* common;
+    PlayerSim sim;
+};
+
+// Everything the render thread draws a frame from, filled by the main thread (see FrameHandoff)
+struct FrameSnapshot {
+    bool playing;
+    // Editor view
+    float editor_z;
+    // Chunks [cur_segment, cur_segment_end) of the current segment
+    uint32_t cur_segment, cur_segment_end;
+    // Tile/sector cursor, drawn over the level; cur_chunk is the segment it's in (not drawn in streamed levels)
+    bool show_cursor;
+    uint32_t cur_chunk, cur_sector, cur_spot;
+    SegmentMode segment_mode;
+    MeshVisualMode visual_mode;
+    // Game view
+    PlayerSim sim;
+    // When the last simulation step was due, the player is interpolated from there
+    std::chrono::steady_clock::time_point step_time;
+    LevelSnapshot level;
+    bool toggle_overlay;
+    bool print_mesh_stats;
+    // Key presses this snapshot is the first to show
+    std::vector<int64_t> input_times;
+};
+
+// Render thread: owns the GL context and a copy of the level, updated from the snapshots
+struct RenderState {
+    LevelInfo scene;
+    BasicShader shader;
     uint32_t player_vao, player_vbo;
-    float curZ, speed;
+    uint32_t segment_block_buffer;
+    uint32_t segment_block_vao;
+    SegmentBufferMode segment_block_mode;
+    SegmentGeometry segment_block_geometry;
+    // Tile/sector cursor model (see GenerateSectorCursorModel)
+    uint32_t cursor_buffer;
+    uint32_t cursor_vao;
+    SegmentGeometry cursor_geometry;
+    std::vector<int32_t> cursor_first, cursor_count; // Sector cursor draw ranges
 };
 
 static void editor_init(void* common_ctx, void* ctx) {
@@ -95,34 +111,54 @@ static void editor_init(void* common_ctx, void* ctx) {
     s_ctx.common = &s_common;
     s_ctx.cur_segment = s_ctx.cur_sector = s_ctx.cur_spot = 0;
     s_ctx.segment_mode = SegmentMode::Tile;
-    glGenBuffers(1, &s_ctx.segment_block_buffer);
-    glGenVertexArrays(1, &s_ctx.segment_block_vao);
-
-    glBindVertexArray(s_ctx.segment_block_vao);
-    glBindBuffer(GL_ARRAY_BUFFER, s_ctx.segment_block_buffer);
-    glVertexAttribPointer(0, 3, GL_FLOAT, false, sizeof(Vtx), reinterpret_cast<const void*>(offsetof(Vtx, pos)));
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, 3, GL_FLOAT, false, sizeof(Vtx), reinterpret_cast<const void*>(offsetof(Vtx, col)));
-    glEnableVertexAttribArray(1);
-
     s_ctx.curZ = 0.0f;
-    s_ctx.segment_block_geometry.floors = 0;
-    s_ctx.segment_block_mode = SegmentBufferMode::Solid;
     s_ctx.segment_visual_mode = MeshVisualMode::Outline;
+    s_ctx.edits_pending = false;
+}
+
+// Rebalances the edited chunk and recomputes the sector offsets, once for all the sector edits since the last commit
+// (a held key inserts or erases a sector per repeat, possibly several times per frame)
+static void CommitEdits(EditorState& state) {
+    if (!state.edits_pending)
+        return;
+    state.edits_pending = false;
+    LevelInfo& level = state.common->level;
+    RebalanceChunk(level, state.cur_segment, state.cur_sector);
+    UpdateSectorOffsets(level);
 }
 
-static void ToggleSectorMark(GeometrySegment& seg, uint32_t sector, uint32_t num_slots) {
-    for (uint32_t slot = 0; slot != num_slots; ++slot) {
-        seg.data[sector * num_slots + slot] ^= 2;
+// Sector mode insertion or deletion, these only change the current chunk until the next commit
+static bool IsSectorEdit(EditorState const& state, WinEvent const& ev) {
+    if (ev.type != EventType::KeyDown or state.segment_mode != SegmentMode::Sector)
+        return false;
+    switch (ev.key.lkey) {
+    case LogicalKey::PageUp: case LogicalKey::Insert:
+    case LogicalKey::PageDown: case LogicalKey::Delete:
+        return true;
+    default:
+        return false;
     }
 }
 
 static void editor_input(WinEvent const& ev, void* ctx) {
     EditorState& state = *reinterpret_cast<EditorState*>(ctx);
+    // Anything else may move to another chunk or rely on the layout
+    if (!IsSectorEdit(state, ev))
+        CommitEdits(state);
     LevelInfo& level = state.common->level;
     GeometrySegment& seg = *level.segments[state.cur_segment];
     uint32_t num_slots = seg.geo.floors * seg.geo.floor_planes;
     if (ev.type == EventType::KeyDown) {
+        // Streamed levels are read-only, only the view can be moved
+        if (level.stream) {
+            switch (ev.key.lkey) {
+            case LogicalKey::W: case LogicalKey::S: case LogicalKey::O:
+            case LogicalKey::L: case LogicalKey::K:
+                break;
+            default:
+                return;
+            }
+        }
         switch (ev.key.lkey) {
         case LogicalKey::W:
             state.curZ += 0.02f;
@@ -134,26 +170,21 @@ static void editor_input(WinEvent const& ev, void* ctx) {
         case LogicalKey::M: {
             switch (state.segment_mode) {
                 case SegmentMode::Tile:
-                    // Unmark the tile
-                    seg.data[state.cur_sector * num_slots + state.cur_spot] ^= 2;
                     state.segment_mode = SegmentMode::Sector;
-                    // Mark the sector
-                    ToggleSectorMark(seg, state.cur_sector, num_slots);
-                    // Regenerate scene
-                    GenerateLevelSceneModel(seg);
                     break;
-                case SegmentMode::Sector:
-                    // Unmark the sector
-                    ToggleSectorMark(seg, state.cur_sector, num_slots);
+                case SegmentMode::Sector: {
                     state.segment_mode = SegmentMode::Segment;
-                    GenerateLevelSceneModel(seg);
+                    // The whole run of chunks is selected
+                    uint32_t const first = SegmentRunBegin(level, state.cur_segment);
+                    if (first != state.cur_segment) {
+                        state.cur_segment = first;
+                        state.cur_sector = 0;
+                    }
                     break;
+                }
                 case SegmentMode::Segment:
                     // Recycle the segment buffer
                     state.segment_mode = SegmentMode::Tile;
-                    // Mark the tile
-                    seg.data[state.cur_sector * num_slots + state.cur_spot] ^= 2;
-                    GenerateLevelSceneModel(seg);
                     break;
             }
             break;
@@ -170,114 +201,97 @@ static void editor_input(WinEvent const& ev, void* ctx) {
         case LogicalKey::ArrowLeft: {
             if (state.segment_mode != SegmentMode::Tile)
                 break;
-            uint32_t new_spot = state.cur_spot;
-            if (new_spot-- == 0) {
-                new_spot = num_slots - 1;
+            if (state.cur_spot-- == 0) {
+                state.cur_spot = num_slots - 1;
             }
-            // Mark the new spot
-            seg.data[state.cur_sector * num_slots + state.cur_spot] ^= 2;
-            seg.data[state.cur_sector * num_slots + new_spot] ^= 2;
-            state.cur_spot = new_spot;
-            // Regenerate segment
-            GenerateLevelSceneModel(seg);
             break;
         }
         case LogicalKey::ArrowRight: {
             if (state.segment_mode != SegmentMode::Tile)
                 break;
-            uint32_t new_spot = state.cur_spot;
-            if (++new_spot == num_slots) {
-                new_spot = 0;
+            if (++state.cur_spot == num_slots) {
+                state.cur_spot = 0;
             }
-            // Mark the new spot
-            seg.data[state.cur_sector * num_slots + state.cur_spot] ^= 2;
-            seg.data[state.cur_sector * num_slots + new_spot] ^= 2;
-            state.cur_spot = new_spot;
-            // Regenerate scene
-            GenerateLevelSceneModel(seg);
             break;
         }
         case LogicalKey::ArrowDown: {
             if (state.segment_mode == SegmentMode::Segment) {
                 if (state.cur_segment != 0) {
-                    --state.cur_segment;
+                    state.cur_segment = SegmentRunBegin(level, state.cur_segment - 1);
                     state.cur_spot = 0;
                     state.cur_sector = 0;
                 }
                 break;
             }
-            uint32_t new_sector = state.cur_sector;
-            if (new_sector-- != 0) {
-                // Mark the new spot
-                if (state.segment_mode == SegmentMode::Tile) {
-                    seg.data[state.cur_sector * num_slots + state.cur_spot] ^= 2;
-                    seg.data[new_sector * num_slots + state.cur_spot] ^= 2;
-                } else {
-                    ToggleSectorMark(seg, state.cur_sector, num_slots);
-                    ToggleSectorMark(seg, new_sector, num_slots);
-                }
-                state.cur_sector = new_sector;
-                // Regenerate scene
-                GenerateLevelSceneModel(seg);
-            } // TODO: Move between segments
+            if (state.cur_sector == 0) {
+                if (!seg.joined)
+                    break; // TODO: Move between segments
+                // Into the previous chunk
+                state.cur_sector = level.segments[--state.cur_segment]->geo.sectors;
+            }
+            --state.cur_sector;
             break;
         }
         case LogicalKey::ArrowUp: {
             if (state.segment_mode == SegmentMode::Segment) {
-                if (state.cur_segment + 1 < level.segments.size()) {
-                    ++state.cur_segment;
+                uint32_t const next = SegmentRunEnd(level, state.cur_segment);
+                if (next < level.segments.size()) {
+                    state.cur_segment = next;
                     state.cur_spot = 0;
                     state.cur_sector = 0;
                 }
                 break;
             }
-            uint32_t new_sector = state.cur_sector;
-            if (++new_sector >= seg.geo.sectors) {
+            if (state.cur_sector + 1 >= seg.geo.sectors) {
+                // Into the next chunk
+                if (state.cur_segment + 1 < level.segments.size() and level.segments[state.cur_segment + 1]->joined) {
+                    ++state.cur_segment;
+                    state.cur_sector = 0;
+                }
                 // Temporarily disable the ability to make new sectors just by navigation
-                break;
                 // TODO: Move between segments if present
-                //seg.data.resize(seg.data.size() + num_slots);
+                //seg.grid.InsertSectors(seg.geo.sectors, 1);
                 //++seg.geo.sectors;
+                break;
             }
-            // Mark the new spot
-            if (state.segment_mode == SegmentMode::Tile) {
-                seg.data[state.cur_sector * num_slots + state.cur_spot] ^= 2;
-                seg.data[new_sector * num_slots + state.cur_spot] ^= 2;
-            } else {
-                ToggleSectorMark(seg, state.cur_sector, num_slots);
-                ToggleSectorMark(seg, new_sector, num_slots);
-            }
-            state.cur_sector = new_sector;
-            // Regenerate scene
-            GenerateLevelSceneModel(seg);
+            ++state.cur_sector;
             break;
         }
         case LogicalKey::Space: {
             if (state.segment_mode != SegmentMode::Tile)
                 break;
             // Set/reset the spot
-            seg.data[state.cur_sector * num_slots + state.cur_spot] ^= 1;
-            // Regenerate scene
-            GenerateLevelSceneModel(seg);
+            seg.grid.TogglePresent(state.cur_sector * num_slots + state.cur_spot);
+            MarkSegmentDirty(seg, state.cur_sector);
             break;
         }
         case LogicalKey::P: {
-            DumpLevelToFile(state.common->level, "level.dat");
-            std::puts("Dumped level to file 'level.dat'");
+            if (DumpLevelToFile(state.common->level, "level.dat"))
+                std::puts("Dumped level to file 'level.dat'");
             break;
         }
         case LogicalKey::L: {
-            if (LoadLevelFromFile(level, "level.dat")) {
+            // The models are generated on the render thread
+            if (ReadLevelFromFile(level, "level.dat")) {
                 state.cur_segment = 0;
                 state.cur_sector = 0;
                 state.cur_spot = 0;
                 state.segment_mode = SegmentMode::Tile;
-                level.segments[0]->data[0] ^= 2;
-                GenerateLevelSceneModel(*level.segments[0]);
+                state.common->print_mesh_stats = true;
                 std::puts("Loaded level 'level.dat'");
             }
             break;
         }
+        case LogicalKey::K: {
+            if (OpenLevelStream(level, "level.dat")) {
+                state.cur_segment = 0;
+                state.cur_sector = 0;
+                state.cur_spot = 0;
+                state.segment_mode = SegmentMode::Tile;
+                std::puts("Streaming level 'level.dat'");
+            }
+            break;
+        }
         case LogicalKey::PageUp:
         case LogicalKey::Insert: {
             bool after = ev.key.lkey == LogicalKey::PageUp;
@@ -285,29 +299,27 @@ static void editor_input(WinEvent const& ev, void* ctx) {
             switch (state.segment_mode) {
             case SegmentMode::Tile: break;
             case SegmentMode::Sector:
-                ToggleSectorMark(seg, state.cur_sector, num_slots);
                 seg.geo.sectors += 1;
                 if (after) {
                     state.cur_sector += 1;
                 }
-                seg.data.insert(seg.data.begin() + state.cur_sector * num_slots, num_slots, 0);
-                ToggleSectorMark(seg, state.cur_sector, num_slots);
-                GenerateLevelSceneModel(seg);
+                seg.grid.InsertSectors(state.cur_sector, 1);
+                MarkSegmentChanged(seg);
+                state.edits_pending = true;
                 break;
             case SegmentMode::Segment: {
                 if (after) {
-                    state.cur_segment += 1;
+                    state.cur_segment = SegmentRunEnd(level, state.cur_segment);
                 }
                 GeometrySegment& newseg = **level.segments.emplace(level.segments.begin() + state.cur_segment, new GeometrySegment);
                 // Copy geometry from current segment
                 newseg.geo.floors = seg.geo.floors;
                 newseg.geo.floor_planes = seg.geo.floor_planes;
                 newseg.geo.sectors = 1;
-                newseg.data.resize(newseg.geo.floors * newseg.geo.floor_planes * newseg.geo.sectors, 0);
+                newseg.grid.Reset(newseg.geo.floors * newseg.geo.floor_planes, newseg.geo.sectors, false);
                 state.cur_sector = 0;
                 GetFloorProperties(newseg);
-                SetupSegmentBuffers(newseg);
-                GenerateLevelSceneModel(newseg);
+                UpdateSectorOffsets(level);
                 break;
             }
             }
@@ -322,23 +334,25 @@ static void editor_input(WinEvent const& ev, void* ctx) {
                 case SegmentMode::Sector:
                     if (seg.geo.sectors <= 1)
                         break;
-                    // No need to unmark, since it's getting deleted
-                    seg.data.erase(seg.data.begin() + state.cur_sector * num_slots, seg.data.begin() + (state.cur_sector + 1) * num_slots);
+                    seg.grid.EraseSectors(state.cur_sector, 1);
                     seg.geo.sectors -= 1;
                     if (state.cur_sector == seg.geo.sectors or (back and state.cur_sector > 0)) {
                         state.cur_sector -= 1;
                     }
-                    ToggleSectorMark(seg, state.cur_sector, num_slots);
-                    GenerateLevelSceneModel(seg);
+                    MarkSegmentChanged(seg);
+                    state.edits_pending = true;
                     break;
-                case SegmentMode::Segment:
-                    if (level.segments.size() <= 1)
+                case SegmentMode::Segment: {
+                    uint32_t const end = SegmentRunEnd(level, state.cur_segment);
+                    if (end - state.cur_segment == level.segments.size())
                         break;
-                    level.segments.erase(level.segments.begin() + state.cur_segment);
+                    level.segments.erase(level.segments.begin() + state.cur_segment, level.segments.begin() + end);
+                    UpdateSectorOffsets(level);
                     if (state.cur_segment == level.segments.size() or (back and state.cur_segment > 0)) {
-                        state.cur_segment -= 1;
+                        state.cur_segment = SegmentRunBegin(level, state.cur_segment - 1);
                     }
                     break;
+                }
             }
             break;
         }
@@ -355,58 +369,95 @@ static void editor_input(WinEvent const& ev, void* ctx) {
     }
 }
 
-void RenderLevel(CommonState const& common, float curZ) {
-    glUniform3f(common.shader.loc_uScale, 1.f, 1.f, sLevelZScale);
-    for (auto& seg : common.level.segments) {
-        glUniform3f(common.shader.loc_uDisplacement, 0.f, 0.f, curZ);
-        glBindVertexArray(seg->gl_vao);
-        glDrawArrays(GL_TRIANGLES, 0, seg->vtx_count);
-        curZ -= sLevelZScale * seg->geo.sectors;
-    }
+// Draws the segments [begin, end) as a block
+void RenderLevelWithSegment(RenderState const& render, uint32_t begin, uint32_t end, uint32_t gl_vao, float curZ) {
+    auto const& offsets = render.scene.sector_offsets;
+    RenderLevel(render.shader, render.scene, curZ, begin, end);
+    curZ -= sLevelZScale * offsets[begin];
+    auto const& seg = *render.scene.segments[begin];
+    glBindVertexArray(gl_vao);
+    glUniform3f(render.shader.loc_uDisplacement, 0.f, 0.f, curZ);
+    glUniform3f(render.shader.loc_uScale, 1.f, 1.f, sLevelZScale * (offsets[end] - offsets[begin]));
+    glDrawArrays(GL_TRIANGLES, 0, 6 * seg.geo.floors);
 }
 
-void RenderLevelWithSegment(CommonState const& common, uint32_t segment, uint32_t gl_vao, float curZ) {
-    glUniform3f(common.shader.loc_uScale, 1.f, 1.f, sLevelZScale);
-    for (uint32_t idx = 0; idx != common.level.segments.size(); ++idx) {
-        auto const &seg = *common.level.segments[idx];
-        glUniform3f(common.shader.loc_uDisplacement, 0.f, 0.f, curZ);
-        if (idx == segment) {
-            glBindVertexArray(gl_vao);
-            glUniform3f(common.shader.loc_uScale, 1.f, 1.f, sLevelZScale * seg.geo.sectors);
-            glDrawArrays(GL_TRIANGLES, 0, 6 * seg.geo.floors);
-            glUniform3f(common.shader.loc_uScale, 1.f, 1.f, sLevelZScale);
-        } else {
-            glBindVertexArray(seg.gl_vao);
-            glDrawArrays(GL_TRIANGLES, 0, seg.vtx_count);
-        }
-        curZ -= sLevelZScale * seg.geo.sectors;
-    }
+static void editor_commit(void* ctx) {
+    CommitEdits(*reinterpret_cast<EditorState*>(ctx));
 }
 
-static void editor_render(void* ctx) {
+static void editor_update(void*) {}
+
+static void editor_snapshot(void* ctx, FrameSnapshot& frame) {
     EditorState& state = *reinterpret_cast<EditorState*>(ctx);
+    frame.playing = false;
+    frame.editor_z = state.curZ;
+    // Whole segment, not only the current chunk
+    LevelInfo const& level = state.common->level;
+    frame.cur_segment = SegmentRunBegin(level, state.cur_segment);
+    frame.cur_segment_end = SegmentRunEnd(level, state.cur_segment);
+    frame.show_cursor = !level.stream;
+    frame.cur_chunk = state.cur_segment;
+    frame.cur_sector = state.cur_sector;
+    frame.cur_spot = state.cur_spot;
+    frame.segment_mode = state.segment_mode;
+    frame.visual_mode = state.segment_visual_mode;
+}
+
+// Draws the tile or sector cursor over the level, colored by the presence of the tiles under it
+static void RenderCursor(RenderState& state, FrameSnapshot const& frame) {
+    auto const& seg = *state.scene.segments[frame.cur_chunk];
+    uint32_t const ring = seg.geo.floors * seg.geo.floor_planes;
+    glBindVertexArray(state.cursor_vao);
+    if (state.cursor_geometry.floors != seg.geo.floors or state.cursor_geometry.floor_planes != seg.geo.floor_planes) {
+        glBindBuffer(GL_ARRAY_BUFFER, state.cursor_buffer);
+        GenerateSectorCursorModel(seg.geo);
+        state.cursor_geometry = seg.geo;
+    }
+    float const curZ = frame.editor_z - sLevelZScale * (state.scene.sector_offsets[frame.cur_chunk] + frame.cur_sector);
+    glUniform3f(state.shader.loc_uDisplacement, 0.f, 0.f, curZ);
+    glUniform3f(state.shader.loc_uScale, 1.f, 1.f, sLevelZScale);
+    size_t const slot = size_t(frame.cur_sector) * ring;
+    if (frame.segment_mode == SegmentMode::Tile) {
+        bool const present = seg.grid.Present(slot + frame.cur_spot);
+        glDrawArrays(GL_TRIANGLES, 6 * (present * ring + frame.cur_spot), 6);
+        return;
+    }
+    state.cursor_first.resize(ring);
+    state.cursor_count.assign(ring, 6);
+    for (uint32_t k = 0; k != ring; ++k)
+        state.cursor_first[k] = 6 * (seg.grid.Present(slot + k) * ring + k);
+    glMultiDrawArrays(GL_TRIANGLES, state.cursor_first.data(), state.cursor_count.data(), ring);
+}
+
+static void editor_render(RenderState& state, FrameSnapshot const& frame) {
     glClearColor(0.f, 0.f, 0.f, 1.f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    glUseProgram(state.common->shader.prog);
-    if (state.segment_mode == SegmentMode::Segment) {
-        SegmentGeometry const& seg = state.common->level.segments[state.cur_segment]->geo;
+    auto const window = GetVisibleSectors(state.scene, frame.editor_z);
+    StreamLevel(state.scene, window.begin, window.end);
+
+    glUseProgram(state.shader.prog);
+    if (frame.segment_mode == SegmentMode::Segment) {
+        SegmentGeometry const& seg = state.scene.segments[frame.cur_segment]->geo;
         if (state.segment_block_geometry.floors != seg.floors or state.segment_block_mode != SegmentBufferMode::Solid) {
             glBindBuffer(GL_ARRAY_BUFFER, state.segment_block_buffer);
             GenerateSegmentSelectionModel(seg);
             state.segment_block_geometry.floors = seg.floors;
             state.segment_block_mode = SegmentBufferMode::Solid;
         }
-        RenderLevelWithSegment(*state.common, state.cur_segment, state.segment_block_vao, state.curZ);
+        RenderLevelWithSegment(state, frame.cur_segment, frame.cur_segment_end, state.segment_block_vao, frame.editor_z);
     } else {
-        RenderLevel(*state.common, state.curZ);
-        if (state.segment_visual_mode != MeshVisualMode::None) {
-            auto const& level = state.common->level;
+        RenderLevel(state.shader, state.scene, frame.editor_z);
+        if (frame.show_cursor)
+            RenderCursor(state, frame);
+        if (frame.visual_mode != MeshVisualMode::None) {
+            auto const& level = state.scene;
             glBindBuffer(GL_ARRAY_BUFFER, state.segment_block_buffer);
-            SegmentGeometry const& seg = level.segments[state.cur_segment]->geo;
+            SegmentGeometry seg = level.segments[frame.cur_segment]->geo;
+            seg.sectors = level.sector_offsets[frame.cur_segment_end] - level.sector_offsets[frame.cur_segment];
             bool regen;
             uint32_t line_count;
-            switch (state.segment_visual_mode) {
+            switch (frame.visual_mode) {
             case MeshVisualMode::None: break;
             case MeshVisualMode::Outline:
                 regen = state.segment_block_mode != SegmentBufferMode::Outline or state.segment_block_geometry.floors != seg.floors;
@@ -437,15 +488,12 @@ static void editor_render(void* ctx) {
                 break;
             }
 
-            float curZ = state.curZ;
-            for (auto it = level.segments.begin(), end = it + state.cur_segment; it != end; ++it) {
-                curZ -= sLevelZScale * (**it).geo.sectors;
-            }
+            float const curZ = frame.editor_z - sLevelZScale * level.sector_offsets[frame.cur_segment];
 
-            auto const& shader = state.common->shader;
+            auto const& shader = state.shader;
             glBindVertexArray(state.segment_block_vao);
             glUniform3f(shader.loc_uDisplacement, 0.f, 0.f, curZ);
-            if (state.segment_visual_mode == MeshVisualMode::Outline) {
+            if (frame.visual_mode == MeshVisualMode::Outline) {
                 glUniform3f(shader.loc_uScale, 1.f, 1.f, sLevelZScale * seg.sectors);
             } else {
                 glUniform3f(shader.loc_uScale, 1.f, 1.f, sLevelZScale);
@@ -455,21 +503,10 @@ static void editor_render(void* ctx) {
     }
 }
 
+// The cursor isn't part of the level, it's only drawn in the editor's frames
 static void editor_switch(void* ctx) {
-    EditorState& state = *reinterpret_cast<EditorState*>(ctx);
-    GeometrySegment& seg = *state.common->level.segments[state.cur_segment];
-    switch (state.segment_mode) {
-        case SegmentMode::Tile:
-            seg.data[state.cur_sector * seg.geo.floors * seg.geo.floor_planes + state.cur_spot] ^= 2;
-            break;
-        case SegmentMode::Sector:
-            ToggleSectorMark(seg, state.cur_sector, seg.geo.floors * seg.geo.floor_planes);
-            break;
-        case SegmentMode::Segment:
-            // Already clean
-            break;
-    }
-    GenerateLevelSceneModel(seg);
+    // The game mode needs the level layout
+    CommitEdits(*reinterpret_cast<EditorState*>(ctx));
 }
 
 static void game_init(void* common_ctx, void* ctx) {
@@ -477,57 +514,55 @@ static void game_init(void* common_ctx, void* ctx) {
     PlayingState& s_ctx = *reinterpret_cast<PlayingState*>(ctx);
 
     s_ctx.common = &s_common;
+    s_ctx.sim = {0.0f, 0.0f, 0.0f};
+}
 
-    glGenVertexArrays(1, &s_ctx.player_vao);
-    glGenBuffers(1, &s_ctx.player_vbo);
-
-    GenerateCharacterModel(s_ctx.player_vbo);
+static void game_input(WinEvent const& ev, void* ctx) {}
 
-    glBindVertexArray(s_ctx.player_vao);
-    glBindBuffer(GL_ARRAY_BUFFER, s_ctx.player_vbo);
-    glVertexAttribPointer(0, 3, GL_FLOAT, false, sizeof(Vtx), reinterpret_cast<const void*>(offsetof(Vtx, pos)));
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, 3, GL_FLOAT, false, sizeof(Vtx), reinterpret_cast<const void*>(offsetof(Vtx, col)));
-    glEnableVertexAttribArray(1);
+static void game_commit(void*) {}
 
-    s_ctx.curZ = 0.0f;
-    s_ctx.speed = 0.0f;
+static void game_update(void* ctx) {
+    PlayingState& state = *reinterpret_cast<PlayingState*>(ctx);
+    StepPlayer(state.sim);
 }
 
-static void game_input(WinEvent const& ev, void* ctx) {}
-
-static void game_render(void* ctx) {
+static void game_snapshot(void* ctx, FrameSnapshot& frame) {
     PlayingState& state = *reinterpret_cast<PlayingState*>(ctx);
+    frame.playing = true;
+    frame.sim = state.sim;
+}
+
+static void game_render(RenderState& state, FrameSnapshot const& frame, float alpha) {
     glClearColor(0.f, 0.f, 0.f, 1.f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     static float const zfactor = -0.08f;
 
-    state.curZ += state.speed;
+    float const curZ = InterpolatePlayerZ(frame.sim, alpha);
+
+    auto const window = GetVisibleSectors(state.scene, curZ + zfactor);
+    StreamLevel(state.scene, window.begin, window.end);
 
-    glUseProgram(state.common->shader.prog);
-    RenderLevel(*state.common, state.curZ + zfactor);
+    glUseProgram(state.shader.prog);
+    RenderLevel(state.shader, state.scene, curZ + zfactor);
 
     glBindVertexArray(state.player_vao);
-    glUniform3f(state.common->shader.loc_uScale, state.common->level.segments[0]->pwidth, .4f, sLevelZScale);
-    glUniform3f(state.common->shader.loc_uDisplacement, 0., state.common->level.segments[0]->yval, zfactor);
+    glUniform3f(state.shader.loc_uScale, state.scene.segments[0]->pwidth, .4f, sLevelZScale);
+    glUniform3f(state.shader.loc_uDisplacement, 0., state.scene.segments[0]->yval, zfactor);
     glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 }
 
 static void game_switch(void* ctx) {
     PlayingState& state = *reinterpret_cast<PlayingState*>(ctx);
-    state.curZ = 0.0f;
-    state.speed = 0.002f;
+    state.sim = {0.0f, 0.0f, cPlayerSpeed};
 }
 
 static void common_init(CommonState& state) {
-    // Init scene
+    // Init scene, the models are generated by the render thread from the first snapshot
     state.level = LoadBlankLevel();
-    SetupSegmentBuffers(*state.level.segments[0]);
-
-    // Load level geometry
-    GenerateLevelSceneModel(*state.level.segments[0]);
+}
 
+static void render_init(RenderState& state) {
     // Load shaders
     uint32_t vs = LoadShaderFromFile("basic.vs.glsl", GL_VERTEX_SHADER);
     uint32_t fs = LoadShaderFromFile("basic.fs.glsl", GL_FRAGMENT_SHADER);
@@ -540,30 +575,139 @@ static void common_init(CommonState& state) {
     //glBindFragDataLocation(shdr, 0, "fColor");
     glBindAttribLocation(shdr, 0, "vPos");
     glBindAttribLocation(shdr, 1, "vColor");
+    glBindAttribLocation(shdr, 2, "vSector");
+    glBindAttribLocation(shdr, 3, "vPaletteIndex");
 
     glLinkProgram(shdr);
     state.shader.prog = shdr;
     state.shader.loc_uScale = glGetUniformLocation(shdr, "uScale");
     state.shader.loc_uDisplacement = glGetUniformLocation(shdr, "uDisplacement");
+    state.shader.loc_uUsePalette = glGetUniformLocation(shdr, "uUsePalette");
+    state.shader.loc_uPalette = glGetUniformLocation(shdr, "uPalette");
+
+    InitLevelRenderer(state.shader);
+
+    // Editor segment block
+    glGenBuffers(1, &state.segment_block_buffer);
+    glGenVertexArrays(1, &state.segment_block_vao);
+
+    glBindVertexArray(state.segment_block_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, state.segment_block_buffer);
+    glVertexAttribPointer(0, 3, GL_FLOAT, false, sizeof(Vtx), reinterpret_cast<const void*>(offsetof(Vtx, pos)));
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 3, GL_FLOAT, false, sizeof(Vtx), reinterpret_cast<const void*>(offsetof(Vtx, col)));
+    glEnableVertexAttribArray(1);
+
+    state.segment_block_geometry.floors = 0;
+    state.segment_block_mode = SegmentBufferMode::Solid;
+
+    // Editor cursor
+    glGenBuffers(1, &state.cursor_buffer);
+    glGenVertexArrays(1, &state.cursor_vao);
+
+    glBindVertexArray(state.cursor_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, state.cursor_buffer);
+    glVertexAttribPointer(0, 3, GL_FLOAT, false, sizeof(Vtx), reinterpret_cast<const void*>(offsetof(Vtx, pos)));
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 3, GL_FLOAT, false, sizeof(Vtx), reinterpret_cast<const void*>(offsetof(Vtx, col)));
+    glEnableVertexAttribArray(1);
+
+    state.cursor_geometry.floors = 0;
+
+    // Player
+    glGenVertexArrays(1, &state.player_vao);
+    glGenBuffers(1, &state.player_vbo);
+
+    GenerateCharacterModel(state.player_vbo);
+
+    glBindVertexArray(state.player_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, state.player_vbo);
+    glVertexAttribPointer(0, 3, GL_FLOAT, false, sizeof(Vtx), reinterpret_cast<const void*>(offsetof(Vtx, pos)));
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 3, GL_FLOAT, false, sizeof(Vtx), reinterpret_cast<const void*>(offsetof(Vtx, col)));
+    glEnableVertexAttribArray(1);
+}
+
+static void render_finish(RenderState& state) {
+    CleanupLevel(state.scene);
+    FinishLevelRenderer();
+    glDeleteVertexArrays(1, &state.player_vao);
+    glDeleteBuffers(1, &state.player_vbo);
+    glDeleteVertexArrays(1, &state.segment_block_vao);
+    glDeleteBuffers(1, &state.segment_block_buffer);
+    glDeleteVertexArrays(1, &state.cursor_vao);
+    glDeleteBuffers(1, &state.cursor_buffer);
+    glDeleteProgram(state.shader.prog);
 }
 
-static void common_finish(CommonState& state, EditorState& s_editor, PlayingState& s_playing) {
-    CleanupLevel(state.level);
-    glDeleteVertexArrays(1, &s_playing.player_vao);
-    glDeleteBuffers(1, &s_playing.player_vbo);
+// Owns the GL context, draws the latest snapshot once per swap until stop is set
+static void RenderThread(WindowState* window, FrameHandoff<FrameSnapshot>& handoff, std::atomic<bool> const& stop) {
+    make_current(window);
+    glewExperimental = true;
+    glewInit();
+    ProfilerRegisterThread("render");
+    InitProfiler();
+
+    RenderState state;
+    render_init(state);
+    handoff.WaitFirst();
+
+    while (!stop.load(std::memory_order_relaxed)) {
+        ProfilerBeginFrame();
+        bool const fresh = handoff.Take();
+        if (fresh) {
+            FrameSnapshot& frame = handoff.Front();
+            ApplyLevelSnapshot(state.scene, frame.level);
+            if (frame.print_mesh_stats)
+                PrintLevelMeshStats(state.scene);
+            if (frame.toggle_overlay)
+                ToggleProfilerOverlay();
+        }
+        FrameSnapshot const& frame = handoff.Front();
+
+        // Render
+        {
+            ProfileScope scope("render");
+            if (frame.playing) {
+                // The snapshot may be older than this frame, the player is interpolated up to now
+                double const since_step = std::chrono::duration<double>(std::chrono::steady_clock::now() - frame.step_time).count();
+                game_render(state, frame, static_cast<float>(std::clamp(since_step / cSimStep, 0.0, 1.0)));
+            } else {
+                editor_render(state, frame);
+            }
+            RenderProfilerOverlay();
+        }
+        {
+            ProfileScope scope("swap");
+            window_swap(window);
+        }
+        // The input of a new snapshot is on the screen now
+        if (fresh)
+            for (int64_t const time : frame.input_times)
+                RecordInputLatency(time);
+    }
+
+    // Deinit
+    FinishProfiler();
+    render_finish(state);
+    release_current(window);
 }
 
 int main() {
     static GameStateDef state_def_editor {
         &editor_init,
         &editor_input,
-        &editor_render,
+        &editor_commit,
+        &editor_update,
+        &editor_snapshot,
         &editor_switch
     };
     static GameStateDef state_def_game {
         &game_init,
         &game_input,
-        &game_render,
+        &game_commit,
+        &game_update,
+        &game_snapshot,
         &game_switch
     };
 
@@ -578,7 +722,7 @@ int main() {
     {
         InitParams params = {
             .gl_major = 3,
-            .gl_minor = 2,
+            .gl_minor = 3,
             .stencil_size = 8,
             .init_width = 800,
             .init_height = 800,
@@ -590,43 +734,98 @@ int main() {
         }
     }
 
-    make_current(window);
-    glewExperimental = true;
-    glewInit();
-
     // Main loop
+    ProfilerRegisterThread("main");
     common_init(s_common);
     editor_init(&s_common, &s_editor);
     game_init(&s_common, &s_game);
 
     state->change(state_ctx);
 
-    WinEvent ev;
+    // Longest time simulated per frame, longer stalls slow the game down instead
+    static constexpr double cMaxFrameTime = 0.25;
+    // The main thread doesn't wait for the render thread, events are polled at this interval instead
+    static constexpr auto cEventPollInterval = std::chrono::milliseconds(1);
+    // Time not simulated yet
+    double sim_time = 0.0;
+    auto last_time = std::chrono::steady_clock::now();
+
+    // Input and simulation run on this thread, rendering on its own thread
+    // The handoff is lock-free, so a slow frame (like one generating big models) doesn't hold up the input
+    static FrameHandoff<FrameSnapshot> handoff;
+    std::atomic<bool> stop = false;
+    auto const publish = [&] {
+        // Otherwise the changes stay marked in the level and go with a later snapshot
+        if (!handoff.CanPublish())
+            return;
+        // Edits are applied to the level as the events come, but only their level-wide effects once per frame
+        {
+            ProfileScope scope("commit");
+            state->commit(state_ctx);
+        }
+        ProfileScope scope("snapshot");
+        FrameSnapshot& frame = handoff.Back();
+        frame.step_time = last_time - std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(sim_time));
+        TakeLevelSnapshot(s_common.level, frame.level);
+        state->snapshot(state_ctx, frame);
+        frame.toggle_overlay = std::exchange(s_common.toggle_overlay, false);
+        frame.print_mesh_stats = std::exchange(s_common.print_mesh_stats, false);
+        // Swapped, so both vectors keep their storage
+        std::swap(frame.input_times, s_common.input_times);
+        s_common.input_times.clear();
+        handoff.Publish();
+    };
+    publish();
+    release_current(window);
+    std::thread render_thread(RenderThread, window, std::ref(handoff), std::cref(stop));
+
+    // Drained a batch at a time, a batch usually holds all the events of the iteration
+    std::array<WinEvent, 64> events;
     while (true) {
-        while (window_pop_event(window, ev)) {
-            if (ev.type == EventType::Quit)
-                goto end_prog;
-            else if (ev.type == EventType::KeyDown && ev.key.lkey == LogicalKey::B) {
-                state->change(state_ctx);
-                if (state == &state_def_editor) {
-                    state = &state_def_game;
-                    state_ctx = &s_game;
-                } else {
-                    state = &state_def_editor;
-                    state_ctx = &s_editor;
+        {
+            ProfileScope scope("events");
+            while (size_t const count = window_pop_events(window, events)) {
+                for (WinEvent const& ev : std::span(events).first(count)) {
+                    if (ev.type == EventType::Quit)
+                        goto end_prog;
+                    if (ev.type == EventType::KeyDown)
+                        s_common.input_times.push_back(ev.common.time);
+                    if (ev.type == EventType::KeyDown && ev.key.lkey == LogicalKey::T)
+                        s_common.toggle_overlay = !s_common.toggle_overlay;
+                    else if (ev.type == EventType::KeyDown && ev.key.lkey == LogicalKey::B) {
+                        state->change(state_ctx);
+                        if (state == &state_def_editor) {
+                            state = &state_def_game;
+                            state_ctx = &s_game;
+                        } else {
+                            state = &state_def_editor;
+                            state_ctx = &s_editor;
+                        }
+                        state->change(state_ctx);
+                        sim_time = 0.0;
+                    } else
+                        state->handle_event(ev, state_ctx);
                 }
-                state->change(state_ctx);
-            } else
-                state->handle_event(ev, state_ctx);
+            }
         }
 
-        // Render
-        state->render(state_ctx);
-        window_swap(window);
+        // Fixed step simulation
+        auto const now = std::chrono::steady_clock::now();
+        sim_time += std::min(std::chrono::duration<double>(now - last_time).count(), cMaxFrameTime);
+        last_time = now;
+        while (sim_time >= cSimStep) {
+            state->update(state_ctx);
+            sim_time -= cSimStep;
+        }
+
+        publish();
+        std::this_thread::sleep_for(cEventPollInterval);
     }
     end_prog:
 
     // Deinit
-    common_finish(s_common, s_editor, s_game);
+    stop.store(true, std::memory_order_relaxed);
+    render_thread.join();
+    CleanupLevel(s_common.level);
     window_finish(window);
 }
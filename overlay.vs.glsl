@@ -0,0 +1,13 @@
+#version 150 core
+
+// Profiler overlay (see profiler.cpp), positions are in clip space
+
+in vec2 vPos;
+in vec3 vColor;
+
+flat out vec3 vfColor;
+
+void main() {
+    vfColor = vColor;
+    gl_Position = vec4(vPos, 0.0, 1.0);
+}
@@ -0,0 +1,344 @@
+#include "profiler.hpp"
+#include "render.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <GL/glew.h>
+
+// Frames kept in the history (and drawn in the overlay)
+static constexpr size_t cHistoryFrames = 240;
+// GPU query results are read this many frames later, so reading them doesn't wait for the GPU
+static constexpr size_t cQueryLatency = 4;
+static constexpr size_t cMaxGpuScopes = 8; // Per frame
+// The trace of a thread stops growing after this many events (about 32 MB)
+static constexpr size_t cMaxTraceEvents = 1 << 20;
+// Input latencies kept for the summary
+static constexpr size_t cLatencySamples = 1024;
+// Frame time at the top of the overlay graph
+static constexpr float cOverlayMaxMs = 100.f / 3;
+
+static int64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct TraceEvent {
+    char const* name;
+    int64_t begin, duration; // ns
+    bool gpu;
+};
+
+struct ScopeTotal {
+    char const* name;
+    int64_t total; // ns
+};
+
+// Recording buffer of a registered thread
+// Written by its thread, read by the summary and the trace export on the render thread, so it's locked
+struct ThreadProfile {
+    char const* name;
+    std::mutex lock;
+    // Inclusive time of each scope name since the start
+    std::vector<ScopeTotal> totals;
+    std::vector<TraceEvent> trace;
+};
+
+struct GpuFrame {
+    uint64_t frame;
+    size_t count;
+    uint32_t queries[cMaxGpuScopes];
+    char const* names[cMaxGpuScopes];
+    int64_t begins[cMaxGpuScopes]; // CPU time the scopes started at
+};
+
+static struct {
+    int64_t start = NowNs();
+    uint64_t frame = 0; // Current frame
+    int64_t frame_begin = 0;
+    size_t recorded = 0; // Finished frames in the history
+    // Indexed by frame % cHistoryFrames
+    float cpu_ms[cHistoryFrames];
+    float gpu_ms[cHistoryFrames];
+    size_t latencies = 0; // Recorded input latencies
+    // Indexed by sample % cLatencySamples
+    float latency_ms[cLatencySamples];
+
+    bool gl_ready = false;
+    bool gpu_active = false;
+    // Indexed by frame % cQueryLatency
+    GpuFrame gpu[cQueryLatency];
+
+    // Registered threads in order, kept until exit for the trace
+    std::mutex threads_lock;
+    std::vector<std::unique_ptr<ThreadProfile>> threads;
+
+    char const* trace_path = std::getenv("RUN_TRACE");
+
+    bool overlay = false;
+    uint32_t prog, vao, vbo;
+    std::vector<float> overlay_vertices;
+} sProfiler;
+
+// Set on the thread that called InitProfiler
+static thread_local bool sProfilerThread = false;
+// Set on registered threads
+static thread_local ThreadProfile* sThreadProfile = nullptr;
+
+// The thread's lock must be held
+static void RecordEvent(ThreadProfile& thread, char const* name, int64_t begin, int64_t duration, bool gpu) {
+    if (sProfiler.trace_path and thread.trace.size() < cMaxTraceEvents)
+        thread.trace.push_back({name, begin, duration, gpu});
+}
+
+void ProfilerRegisterThread(char const* name) {
+    std::lock_guard guard(sProfiler.threads_lock);
+    sThreadProfile = sProfiler.threads.emplace_back(new ThreadProfile).get();
+    sThreadProfile->name = name;
+}
+
+void InitProfiler() {
+    sProfilerThread = true;
+    for (auto& frame : sProfiler.gpu)
+        glGenQueries(cMaxGpuScopes, frame.queries);
+
+    uint32_t vs = LoadShaderFromFile("overlay.vs.glsl", GL_VERTEX_SHADER);
+    uint32_t fs = LoadShaderFromFile("basic.fs.glsl", GL_FRAGMENT_SHADER);
+    uint32_t prog = glCreateProgram();
+    glAttachShader(prog, vs);
+    glAttachShader(prog, fs);
+    glBindAttribLocation(prog, 0, "vPos");
+    glBindAttribLocation(prog, 1, "vColor");
+    glLinkProgram(prog);
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+    sProfiler.prog = prog;
+
+    // Vertices are XY followed by RGB
+    glGenVertexArrays(1, &sProfiler.vao);
+    glGenBuffers(1, &sProfiler.vbo);
+    glBindVertexArray(sProfiler.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, sProfiler.vbo);
+    glVertexAttribPointer(0, 2, GL_FLOAT, false, 5 * sizeof(float), reinterpret_cast<const void*>(0));
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 3, GL_FLOAT, false, 5 * sizeof(float), reinterpret_cast<const void*>(2 * sizeof(float)));
+    glEnableVertexAttribArray(1);
+    sProfiler.gl_ready = true;
+}
+
+static void WriteTrace() {
+    std::FILE* file = std::fopen(sProfiler.trace_path, "w");
+    if (!file) {
+        std::perror("Could not write trace");
+        return;
+    }
+    // Chrome trace event format, timestamps in microseconds
+    // Each registered thread is a trace thread (tid 1, 2...), followed by the GPU
+    // GPU scopes are placed at the time their commands were issued
+    std::lock_guard guard(sProfiler.threads_lock);
+    size_t const gpu_tid = sProfiler.threads.size() + 1;
+    std::fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", file);
+    for (size_t idx = 0; idx != sProfiler.threads.size(); ++idx)
+        std::fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"%s\"}},\n", idx + 1, sProfiler.threads[idx]->name);
+    std::fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"GPU\"}}", gpu_tid);
+    size_t events = 0;
+    for (size_t idx = 0; idx != sProfiler.threads.size(); ++idx) {
+        ThreadProfile& thread = *sProfiler.threads[idx];
+        std::lock_guard thread_guard(thread.lock);
+        for (auto const& event : thread.trace) {
+            std::fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f}",
+                event.name, event.gpu ? gpu_tid : idx + 1, (event.begin - sProfiler.start) / 1e3, event.duration / 1e3);
+        }
+        events += thread.trace.size();
+    }
+    std::fputs("\n]}\n", file);
+    std::fclose(file);
+    std::printf("Wrote %zu trace events to '%s'\n", events, sProfiler.trace_path);
+}
+
+void FinishProfiler() {
+    if (sProfiler.trace_path)
+        WriteTrace();
+    if (!sProfiler.gl_ready)
+        return;
+    for (auto& frame : sProfiler.gpu)
+        glDeleteQueries(cMaxGpuScopes, frame.queries);
+    glDeleteVertexArrays(1, &sProfiler.vao);
+    glDeleteBuffers(1, &sProfiler.vbo);
+    glDeleteProgram(sProfiler.prog);
+    sProfiler.gl_ready = false;
+}
+
+// Reads the query results of a frame cQueryLatency frames ago
+static void CollectGpuFrame(GpuFrame& gpu) {
+    if (gpu.count == 0)
+        return;
+    // The events go to the trace of this thread
+    std::unique_lock<std::mutex> guard;
+    if (sThreadProfile)
+        guard = std::unique_lock(sThreadProfile->lock);
+    for (size_t i = 0; i != gpu.count; ++i) {
+        uint64_t ns;
+        glGetQueryObjectui64v(gpu.queries[i], GL_QUERY_RESULT, &ns);
+        if (sProfiler.frame - gpu.frame < cHistoryFrames)
+            sProfiler.gpu_ms[gpu.frame % cHistoryFrames] += ns / 1e6f;
+        if (sThreadProfile)
+            RecordEvent(*sThreadProfile, gpu.names[i], gpu.begins[i], ns, true);
+    }
+    gpu.count = 0;
+}
+
+void ProfilerBeginFrame() {
+    int64_t const now = NowNs();
+    if (sProfiler.frame_begin) {
+        sProfiler.cpu_ms[sProfiler.frame % cHistoryFrames] = (now - sProfiler.frame_begin) / 1e6f;
+        if (sThreadProfile) {
+            std::lock_guard guard(sThreadProfile->lock);
+            RecordEvent(*sThreadProfile, "frame", sProfiler.frame_begin, now - sProfiler.frame_begin, false);
+        }
+        sProfiler.recorded = std::min(sProfiler.recorded + 1, cHistoryFrames);
+        ++sProfiler.frame;
+    }
+    sProfiler.frame_begin = now;
+    sProfiler.gpu_ms[sProfiler.frame % cHistoryFrames] = 0.f;
+
+    GpuFrame& gpu = sProfiler.gpu[sProfiler.frame % cQueryLatency];
+    CollectGpuFrame(gpu);
+    gpu.frame = sProfiler.frame;
+}
+
+ProfileScope::ProfileScope(char const* name) : name(name), begin(NowNs()) {}
+
+ProfileScope::~ProfileScope() {
+    ThreadProfile* const thread = sThreadProfile;
+    if (!thread)
+        return;
+    int64_t const duration = NowNs() - begin;
+    // Only contended while the summary or the trace is being written
+    std::lock_guard guard(thread->lock);
+    auto it = std::find_if(thread->totals.begin(), thread->totals.end(), [&](ScopeTotal const& t) { return t.name == name; });
+    if (it == thread->totals.end())
+        it = thread->totals.insert(it, {name, 0});
+    it->total += duration;
+    RecordEvent(*thread, name, begin, duration, false);
+}
+
+GpuProfileScope::GpuProfileScope(char const* name) : ProfileScope(name) {
+    GpuFrame& gpu = sProfiler.gpu[sProfiler.frame % cQueryLatency];
+    if (!sProfilerThread or !sProfiler.gl_ready or sProfiler.gpu_active or gpu.count == cMaxGpuScopes)
+        return;
+    glBeginQuery(GL_TIME_ELAPSED, gpu.queries[gpu.count]);
+    gpu.names[gpu.count] = name;
+    gpu.begins[gpu.count] = begin;
+    sProfiler.gpu_active = true;
+    timed = true;
+}
+
+GpuProfileScope::~GpuProfileScope() {
+    if (!timed)
+        return;
+    glEndQuery(GL_TIME_ELAPSED);
+    ++sProfiler.gpu[sProfiler.frame % cQueryLatency].count;
+    sProfiler.gpu_active = false;
+}
+
+static void PrintFrameSummary() {
+    size_t const count = sProfiler.recorded;
+    if (count == 0)
+        return;
+    std::vector<float> cpu, gpu;
+    for (uint64_t frame = sProfiler.frame - count; frame != sProfiler.frame; ++frame) {
+        cpu.push_back(sProfiler.cpu_ms[frame % cHistoryFrames]);
+        // The latest frames don't have their GPU results yet
+        if (sProfiler.frame - frame >= cQueryLatency)
+            gpu.push_back(sProfiler.gpu_ms[frame % cHistoryFrames]);
+    }
+    std::sort(cpu.begin(), cpu.end());
+    std::sort(gpu.begin(), gpu.end());
+    auto const percentile = [](std::vector<float> const& sorted, size_t p) {
+        return sorted.empty() ? 0.f : sorted[std::min(sorted.size() - 1, sorted.size() * p / 100)];
+    };
+    std::printf("Last %zu frames: p50 %.2f ms, p99 %.2f ms, max %.2f ms (GPU p50 %.2f ms, max %.2f ms)\n",
+        count, percentile(cpu, 50), percentile(cpu, 99), cpu.back(), percentile(gpu, 50), gpu.empty() ? 0.f : gpu.back());
+
+    static constexpr float cBuckets[] = {4.f, 8.f, 100.f / 6, 100.f / 3, 50.f, 100.f};
+    size_t prev = 0;
+    float low = 0.f;
+    for (float const high : cBuckets) {
+        size_t const end = std::lower_bound(cpu.begin(), cpu.end(), high) - cpu.begin();
+        std::printf("  %5.1f - %5.1f ms: %4zu %s\n", low, high, end - prev, std::string(60 * (end - prev) / count, '#').c_str());
+        prev = end;
+        low = high;
+    }
+    std::printf("  %5.1f ms -      : %4zu %s\n", low, count - prev, std::string(60 * (count - prev) / count, '#').c_str());
+
+    // Scopes of all threads, per frame of this thread
+    {
+        std::lock_guard guard(sProfiler.threads_lock);
+        for (auto const& thread : sProfiler.threads) {
+            std::lock_guard thread_guard(thread->lock);
+            for (auto const& total : thread->totals)
+                std::printf("  %s %s: %.3f ms per frame\n", thread->name, total.name, total.total / 1e6 / (sProfiler.frame + 1));
+        }
+    }
+
+    if (sProfiler.latencies != 0) {
+        std::vector<float> latency(sProfiler.latency_ms, sProfiler.latency_ms + std::min(sProfiler.latencies, cLatencySamples));
+        std::sort(latency.begin(), latency.end());
+        std::printf("Input latency, last %zu key presses: p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+            latency.size(), percentile(latency, 50), percentile(latency, 99), latency.back());
+    }
+}
+
+void RecordInputLatency(int64_t event_time) {
+    if (!sProfilerThread)
+        return;
+    sProfiler.latency_ms[sProfiler.latencies++ % cLatencySamples] = (NowNs() - event_time) / 1e6f;
+}
+
+void ToggleProfilerOverlay() {
+    sProfiler.overlay = !sProfiler.overlay;
+    if (!sProfiler.overlay)
+        PrintFrameSummary();
+}
+
+void RenderProfilerOverlay() {
+    if (!sProfiler.overlay or !sProfiler.gl_ready)
+        return;
+    // Graph in the bottom left corner, one bar per frame (oldest on the left)
+    float const left = -0.98f, bottom = -0.98f, width = 0.96f, height = 0.4f;
+    float const bar = width / cHistoryFrames;
+    auto& out = sProfiler.overlay_vertices;
+    out.clear();
+    auto const quad = [&](float x0, float y0, float x1, float y1, Col const& col) {
+        for (auto [x, y] : {std::array{x0, y0}, {x1, y0}, {x1, y1}, {x1, y1}, {x0, y1}, {x0, y0}})
+            out.insert(out.end(), {x, y, col[0], col[1], col[2]});
+    };
+    auto const bar_top = [&](float ms) {
+        return bottom + height * std::min(ms / cOverlayMaxMs, 1.f);
+    };
+    quad(left, bottom, left + width, bottom + height, {0.1f, 0.1f, 0.1f});
+    for (size_t i = 0; i != sProfiler.recorded; ++i) {
+        uint64_t const frame = sProfiler.frame - sProfiler.recorded + i;
+        float const cpu = sProfiler.cpu_ms[frame % cHistoryFrames], gpu = sProfiler.gpu_ms[frame % cHistoryFrames];
+        float const x = left + width - (sProfiler.recorded - i) * bar;
+        // Frames over 60 Hz budget are red
+        quad(x, bottom, x + bar, bar_top(cpu), cpu > 100.f / 6 ? Col{0.9f, 0.2f, 0.2f} : Col{0.8f, 0.8f, 0.3f});
+        quad(x + bar / 4, bottom, x + 3 * bar / 4, bar_top(gpu), {0.2f, 0.8f, 0.3f});
+    }
+    // 60 Hz line
+    float const y60 = bar_top(100.f / 6);
+    quad(left, y60, left + width, y60 + 0.004f, {0.5f, 0.5f, 0.5f});
+
+    glUseProgram(sProfiler.prog);
+    glBindVertexArray(sProfiler.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, sProfiler.vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(float) * out.size(), out.data(), GL_STREAM_DRAW);
+    glDrawArrays(GL_TRIANGLES, 0, out.size() / 5);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+
+// Frame profiler: CPU scopes, GPU timer queries, a rolling frame time history and input latencies
+// CPU scopes are recorded on registered threads, each into its own buffer; scopes on other threads are ignored
+// Frames, GPU queries and input latencies are recorded on the thread that called InitProfiler (the render thread)
+
+// Records the CPU scopes of the calling thread from now on, name must be a string literal
+void ProfilerRegisterThread(char const* name);
+
+// Creates the GL objects; if RUN_TRACE is set, a Chrome trace JSON of all threads is written to that file by FinishProfiler
+void InitProfiler();
+void FinishProfiler();
+
+// Starts the next frame (and ends the previous one)
+void ProfilerBeginFrame();
+
+// Times the code until the end of the scope, name must be a string literal
+struct ProfileScope {
+    char const* name;
+    int64_t begin; // ns
+
+    explicit ProfileScope(char const* name);
+    ~ProfileScope();
+
+    ProfileScope(ProfileScope const&) = delete;
+    ProfileScope& operator=(ProfileScope const&) = delete;
+};
+
+// Also times the GL commands issued in the scope with a GL_TIME_ELAPSED query
+// The queries can't be nested, so only the outermost GPU scope is measured
+struct GpuProfileScope : ProfileScope {
+    bool timed = false;
+
+    explicit GpuProfileScope(char const* name);
+    ~GpuProfileScope();
+};
+
+// Records the time from an input event (see EventTimeNow) until now, call when the frame showing it was swapped
+void RecordInputLatency(int64_t event_time);
+
+// Shows/hides the frame time graph, a summary of the recorded frames is printed when it's hidden
+void ToggleProfilerOverlay();
+// Draws the graph over the frame (if shown), leaves the program and VAO bindings changed
+void RenderProfilerOverlay();
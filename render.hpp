@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+#include <GL/glew.h>
+
+#include "run.hpp"
+#include "profiler.hpp"
+
+// Far plane distance, must match `far` in the vertex shaders
+inline constexpr float sViewFar = 100.f;
+
+struct SectorWindow {
+    uint32_t begin, end;
+};
+
+// Range of level sectors between the camera and the far plane, when the level starts at curZ
+inline SectorWindow GetVisibleSectors(LevelInfo const& level, float curZ) {
+    float const total = level.sector_offsets.back();
+    // Sector t spans Z in [curZ - scale*(t+1), curZ - scale*t]
+    float const begin = std::floor(curZ / sLevelZScale);
+    float const end = std::ceil((curZ + sViewFar) / sLevelZScale);
+    return {
+        static_cast<uint32_t>(std::clamp(begin, 0.f, total)),
+        static_cast<uint32_t>(std::clamp(end, 0.f, total)),
+    };
+}
+
+struct BasicShader {
+    uint32_t prog;
+
+    int32_t loc_uScale;
+    int32_t loc_uDisplacement;
+    int32_t loc_uUsePalette;
+    int32_t loc_uPalette;
+};
+
+uint32_t LoadShaderFromFile(char const* fname, GLenum type);
+
+// Level renderer interface, implemented by one of the render_*.cpp files (selected in compile.sh)
+
+// Called once the basic shader is linked
+extern void InitLevelRenderer(BasicShader const& shader);
+extern void FinishLevelRenderer();
+
+extern void SetupSegmentBuffers(GeometrySegment& seg);
+extern void ReleaseSegmentBuffers(GeometrySegment& seg);
+
+/// Sector-0 is at Z=0
+/// Sector-n is at Z=-n (increment is Z += -1 for each next sector)
+/// All XY coords are inside the unit circle (radius 1)
+/// Order of floors/planes counter-clockwise
+// Makes no GL calls, so it can run on any thread (and without a GL context)
+extern void BuildSegmentMesh(SegmentGeometry const& geo, TileGrid const& grid, SegmentMeshData& mesh);
+// Uploads the data built for the segment's current geometry and grid (buffers must be set up)
+extern void UploadSegmentMesh(GeometrySegment& seg, SegmentMeshData const& mesh);
+
+inline void GenerateLevelSceneModel(GeometrySegment& seg) {
+    ProfileScope scope("GenerateLevelSceneModel");
+    SegmentMeshData mesh;
+    BuildSegmentMesh(seg.geo, seg.grid, mesh);
+    UploadSegmentMesh(seg, mesh);
+}
+// Re-uploads only the dirty sectors (or the whole model if the sector count changed)
+extern void UpdateLevelSceneModel(GeometrySegment& seg);
+// Prints the GPU memory used by the level models
+extern void PrintLevelMeshStats(LevelInfo const& level);
+
+// Draws the visible sectors of all segments but [skip_begin, skip_end); the basic shader is bound on return
+extern void RenderLevel(BasicShader const& shader, LevelInfo const& level, float curZ, uint32_t skip_begin = UINT32_MAX, uint32_t skip_end = UINT32_MAX);
@@ -0,0 +1,303 @@
+#include "render.hpp"
+
+#include <cstdio>
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+
+// Instanced renderer: every slot of the level is an instance of one unit quad,
+// all segments share a single instance buffer and are drawn with one call
+// Instance sectors are relative to their segment, so a layout change only writes the instances of the changed segments
+
+struct TileInstance {
+    float sector; // Sector index in the segment
+    uint32_t segment; // Entry of the segment in the offset table (GeometrySegment::gpu_slot)
+    // Level files store floors and floor planes in 16 bits
+    uint16_t floor;
+    uint16_t plane;
+    uint16_t floors;
+    uint16_t planes;
+    uint8_t color; // Index into the tile palette, 0 is an empty slot
+    uint8_t pad[3];
+};
+
+static struct {
+    uint32_t prog;
+    uint32_t vao;
+    uint32_t quad_vbo;
+    uint32_t instance_vbo;
+    // Offset table: first level sector of each segment, read through a buffer texture
+    uint32_t offset_buffer;
+    uint32_t offset_tex;
+    uint32_t slot_count;
+    std::vector<uint32_t> free_slots;
+    int32_t loc_uScale;
+    int32_t loc_uDisplacement;
+    size_t instance_count;
+    // Set when a segment was added, removed or resized, the instances are laid out again before drawing
+    bool layout_dirty;
+} sRenderer;
+
+// Triangles of the unit quad (plane, sector offset), both end on the front-left corner (provoking vertex)
+static float const sQuadCorners[6][2] = {
+    {1.f, 0.f}, {1.f, 1.f}, {0.f, 0.f},
+    {1.f, 1.f}, {0.f, 1.f}, {0.f, 0.f},
+};
+
+static TileInstance* GenerateSectorInstances(GeometrySegment const& seg, uint32_t z, TileInstance* out) {
+    seg.grid.ForEachSectorSlot(z, [&](uint32_t k, uint8_t value) {
+        *out++ = {
+            .sector = static_cast<float>(z),
+            .segment = seg.gpu_slot,
+            .floor = static_cast<uint16_t>(k / seg.geo.floor_planes),
+            .plane = static_cast<uint16_t>(k % seg.geo.floor_planes),
+            .floors = static_cast<uint16_t>(seg.geo.floors),
+            .planes = static_cast<uint16_t>(seg.geo.floor_planes),
+            .color = value,
+            .pad = {},
+        };
+    });
+    return out;
+}
+
+// Points the per-instance attributes at the given instance
+static void BindInstanceRange(size_t first) {
+    size_t const base = first * sizeof(TileInstance);
+    glBindBuffer(GL_ARRAY_BUFFER, sRenderer.instance_vbo);
+    glVertexAttribPointer(1, 1, GL_FLOAT, false, sizeof(TileInstance), reinterpret_cast<const void*>(base + offsetof(TileInstance, sector)));
+    glVertexAttribIPointer(2, 4, GL_UNSIGNED_SHORT, sizeof(TileInstance), reinterpret_cast<const void*>(base + offsetof(TileInstance, floor)));
+    glVertexAttribIPointer(3, 1, GL_UNSIGNED_BYTE, sizeof(TileInstance), reinterpret_cast<const void*>(base + offsetof(TileInstance, color)));
+    glVertexAttribIPointer(4, 1, GL_UNSIGNED_INT, sizeof(TileInstance), reinterpret_cast<const void*>(base + offsetof(TileInstance, segment)));
+}
+
+// Moves the instances to a new buffer in level order, so any sector range stays contiguous
+// The instances of unchanged segments are copied on the GPU, only new, resized and edited segments are generated
+static void UpdateInstanceLayout(LevelInfo const& level) {
+    size_t count = 0;
+    for (auto& seg : level.segments) {
+        if (seg->resident)
+            count += seg->geo.floors * seg->geo.floor_planes * seg->geo.sectors;
+    }
+
+    uint32_t buffer;
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, sizeof(TileInstance) * count, nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_COPY_READ_BUFFER, sRenderer.instance_vbo);
+    // Copies of adjacent unchanged segments are merged
+    size_t copy_src = 0, copy_dst = 0, copy_count = 0;
+    auto const flush_copy = [&] {
+        if (copy_count)
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, sizeof(TileInstance) * copy_src, sizeof(TileInstance) * copy_dst, sizeof(TileInstance) * copy_count);
+        copy_count = 0;
+    };
+
+    std::vector<uint32_t> offsets(sRenderer.slot_count);
+    std::vector<TileInstance> buf;
+    size_t base = 0;
+    for (uint32_t idx = 0; idx != level.segments.size(); ++idx) {
+        GeometrySegment& seg = *level.segments[idx];
+        // Non-resident segments have no instances
+        size_t const seg_count = seg.resident ? seg.geo.floors * seg.geo.floor_planes * seg.geo.sectors : 0;
+        if (seg.gpu_ready)
+            offsets[seg.gpu_slot] = level.sector_offsets[idx];
+        if (seg_count != 0 and seg.vtx_count == seg_count and seg.dirty_begin == seg.dirty_end) {
+            if (copy_count == 0 or copy_src + copy_count != seg.gpu_base or copy_dst + copy_count != base) {
+                flush_copy();
+                copy_src = seg.gpu_base;
+                copy_dst = base;
+            }
+            copy_count += seg_count;
+        } else if (seg_count != 0) {
+            buf.resize(seg_count);
+            TileInstance* out = buf.data();
+            for (uint32_t z = 0; z != seg.geo.sectors; ++z) {
+                out = GenerateSectorInstances(seg, z, out);
+            }
+            glBufferSubData(GL_COPY_WRITE_BUFFER, sizeof(TileInstance) * base, sizeof(TileInstance) * seg_count, buf.data());
+        }
+        seg.gpu_base = base;
+        seg.vtx_count = seg_count;
+        seg.dirty_begin = seg.dirty_end = 0;
+        base += seg_count;
+    }
+    flush_copy();
+    glDeleteBuffers(1, &sRenderer.instance_vbo);
+    sRenderer.instance_vbo = buffer;
+
+    glBindBuffer(GL_TEXTURE_BUFFER, sRenderer.offset_buffer);
+    glBufferData(GL_TEXTURE_BUFFER, sizeof(uint32_t) * offsets.size(), offsets.data(), GL_DYNAMIC_DRAW);
+    sRenderer.instance_count = count;
+    sRenderer.layout_dirty = false;
+}
+
+void InitLevelRenderer(BasicShader const& shader) {
+    uint32_t vs = LoadShaderFromFile("level_instanced.vs.glsl", GL_VERTEX_SHADER);
+    uint32_t fs = LoadShaderFromFile("basic.fs.glsl", GL_FRAGMENT_SHADER);
+
+    uint32_t prog = glCreateProgram();
+    glAttachShader(prog, vs);
+    glAttachShader(prog, fs);
+    glBindAttribLocation(prog, 0, "vCorner");
+    glBindAttribLocation(prog, 1, "vSector");
+    glBindAttribLocation(prog, 2, "vTile");
+    glBindAttribLocation(prog, 3, "vColorIndex");
+    glBindAttribLocation(prog, 4, "vSegment");
+    glLinkProgram(prog);
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+
+    sRenderer.prog = prog;
+    sRenderer.loc_uScale = glGetUniformLocation(prog, "uScale");
+    sRenderer.loc_uDisplacement = glGetUniformLocation(prog, "uDisplacement");
+
+    glUseProgram(prog);
+    UploadLevelPalette(glGetUniformLocation(prog, "uPalette"));
+    glUniform1i(glGetUniformLocation(prog, "uSegmentOffsets"), 0);
+    glUseProgram(shader.prog);
+
+    glGenVertexArrays(1, &sRenderer.vao);
+    glGenBuffers(1, &sRenderer.quad_vbo);
+    glGenBuffers(1, &sRenderer.instance_vbo);
+    glGenBuffers(1, &sRenderer.offset_buffer);
+    glGenTextures(1, &sRenderer.offset_tex);
+    glBindBuffer(GL_TEXTURE_BUFFER, sRenderer.offset_buffer);
+    glBindTexture(GL_TEXTURE_BUFFER, sRenderer.offset_tex);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, sRenderer.offset_buffer);
+
+    glBindVertexArray(sRenderer.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, sRenderer.quad_vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(sQuadCorners), sQuadCorners, GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 2, GL_FLOAT, false, sizeof(sQuadCorners[0]), nullptr);
+    glEnableVertexAttribArray(0);
+    BindInstanceRange(0);
+    for (uint32_t attr = 1; attr <= 4; ++attr) {
+        glVertexAttribDivisor(attr, 1);
+        glEnableVertexAttribArray(attr);
+    }
+    sRenderer.instance_count = 0;
+    sRenderer.layout_dirty = true;
+}
+
+void FinishLevelRenderer() {
+    glDeleteVertexArrays(1, &sRenderer.vao);
+    glDeleteBuffers(1, &sRenderer.quad_vbo);
+    glDeleteBuffers(1, &sRenderer.instance_vbo);
+    glDeleteBuffers(1, &sRenderer.offset_buffer);
+    glDeleteTextures(1, &sRenderer.offset_tex);
+    glDeleteProgram(sRenderer.prog);
+    sRenderer.slot_count = 0;
+    sRenderer.free_slots.clear();
+}
+
+void SetupSegmentBuffers(GeometrySegment& seg) {
+    if (!seg.gpu_ready) {
+        if (sRenderer.free_slots.empty()) {
+            seg.gpu_slot = sRenderer.slot_count++;
+        } else {
+            seg.gpu_slot = sRenderer.free_slots.back();
+            sRenderer.free_slots.pop_back();
+        }
+    }
+    seg.gpu_ready = true;
+    sRenderer.layout_dirty = true;
+}
+
+void ReleaseSegmentBuffers(GeometrySegment& seg) {
+    // Segments of the main thread's level are never drawn, the layout is the render thread's
+    if (!seg.gpu_ready)
+        return;
+    sRenderer.free_slots.push_back(seg.gpu_slot);
+    seg.vtx_count = 0;
+    seg.gpu_ready = false;
+    sRenderer.layout_dirty = true;
+}
+
+// Nothing to build per segment, the instances are written when the layout is updated
+void BuildSegmentMesh(SegmentGeometry const&, TileGrid const&, SegmentMeshData&) {}
+
+void UploadSegmentMesh(GeometrySegment& seg, SegmentMeshData const&) {
+    // The segment's instances are written on the next layout update, the other segments are only moved
+    seg.mesh_sectors = seg.geo.sectors;
+    seg.vtx_count = 0;
+    sRenderer.layout_dirty = true;
+}
+
+void UpdateLevelSceneModel(GeometrySegment& seg) {
+    ProfileScope scope("UpdateLevelSceneModel");
+    if (seg.mesh_sectors != seg.geo.sectors) {
+        GenerateLevelSceneModel(seg);
+        return;
+    }
+    if (sRenderer.layout_dirty or seg.dirty_begin == seg.dirty_end)
+        return;
+
+    // Patch only the instances of the dirty sectors
+    uint32_t const ring = seg.geo.floors * seg.geo.floor_planes;
+    std::vector<TileInstance> buf(ring * (seg.dirty_end - seg.dirty_begin));
+    TileInstance* out = buf.data();
+    for (uint32_t z = seg.dirty_begin; z != seg.dirty_end; ++z) {
+        out = GenerateSectorInstances(seg, z, out);
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, sRenderer.instance_vbo);
+    glBufferSubData(GL_ARRAY_BUFFER, sizeof(TileInstance) * (seg.gpu_base + ring * seg.dirty_begin), sizeof(TileInstance) * buf.size(), buf.data());
+    seg.dirty_begin = seg.dirty_end = 0;
+}
+
+void PrintLevelMeshStats(LevelInfo const& level) {
+    size_t count = 0;
+    for (auto& seg : level.segments) {
+        if (seg->resident)
+            count += seg->geo.floors * seg->geo.floor_planes * seg->geo.sectors;
+    }
+    std::printf("Level instances: %zu bytes (%zu tiles) + %zu quad bytes + %zu offset table bytes\n",
+        sizeof(TileInstance) * count, count, sizeof(sQuadCorners), sizeof(uint32_t) * sRenderer.slot_count);
+}
+
+// Draws the instances of level sectors [begin, end) of the segments [first_segment, end_segment)
+static void DrawInstanceRange(LevelInfo const& level, SectorWindow window, uint32_t first_segment, uint32_t end_segment) {
+    if (first_segment >= end_segment)
+        return;
+    // Instances are in level sector order, so any sector range is contiguous
+    auto const instance_at = [&](uint32_t idx, uint32_t sector) {
+        GeometrySegment const& seg = *level.segments[idx];
+        uint32_t const offset = level.sector_offsets[idx];
+        if (!seg.resident)
+            return seg.gpu_base;
+        sector = std::clamp(sector, offset, offset + seg.geo.sectors) - offset;
+        return seg.gpu_base + sector * seg.geo.floors * seg.geo.floor_planes;
+    };
+    size_t const first = instance_at(first_segment, window.begin);
+    size_t const last = instance_at(end_segment - 1, window.end);
+    if (first >= last)
+        return;
+    BindInstanceRange(first);
+    glDrawArraysInstanced(GL_TRIANGLES, 0, 6, last - first);
+}
+
+void RenderLevel(BasicShader const& shader, LevelInfo const& level, float curZ, uint32_t skip_begin, uint32_t skip_end) {
+    GpuProfileScope scope("RenderLevel");
+    if (sRenderer.layout_dirty) {
+        UpdateInstanceLayout(level);
+    }
+
+    glUseProgram(sRenderer.prog);
+    glBindVertexArray(sRenderer.vao);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_BUFFER, sRenderer.offset_tex);
+    glUniform3f(sRenderer.loc_uScale, 1.f, 1.f, sLevelZScale);
+    glUniform3f(sRenderer.loc_uDisplacement, 0.f, 0.f, curZ);
+    auto const window = GetVisibleSectors(level, curZ);
+    uint32_t const first_segment = FindSegment(level, window.begin);
+    uint32_t const end_segment = std::min<uint32_t>(FindSegment(level, window.end) + 1, level.segments.size());
+    if (skip_begin < end_segment and skip_end > first_segment) {
+        // Draw around the skipped segments
+        DrawInstanceRange(level, window, first_segment, skip_begin);
+        DrawInstanceRange(level, window, skip_end, end_segment);
+    } else {
+        DrawInstanceRange(level, window, first_segment, end_segment);
+    }
+    BindInstanceRange(0);
+    glUseProgram(shader.prog);
+}
@@ -0,0 +1,356 @@
+#include "render.hpp"
+
+#include <cassert>
+#include <cstdio>
+#include <cstddef>
+#include <algorithm>
+#include <map>
+#include <memory>
+
+// Mesh renderer: one indexed mesh per segment, drawn with the basic shader
+// The meshes are sub-allocated from a level-wide vertex buffer and index buffer, drawn through a single VAO
+
+#ifdef RUN_PACKED_VERTICES
+// Compact level vertex (8 bytes), resolved in basic.vs.glsl
+struct PackedVtx {
+    std::array<int16_t, 2> pos; // Normalized XY
+    uint16_t sector; // Z = -sector, segments are split into chunks short enough for it (see cMaxChunkSectors)
+    uint8_t color; // Index into the tile palette
+    uint8_t pad;
+};
+static_assert(cMaxChunkSectors <= UINT16_MAX);
+using LevelVtx = PackedVtx;
+constexpr bool cLevelUsesPalette = true;
+#else
+using LevelVtx = Vtx;
+constexpr bool cLevelUsesPalette = false;
+#endif
+
+// Vertex at the left corner of slot k of the ring at sector z
+#ifdef RUN_PACKED_VERTICES
+static LevelVtx MakeLevelVertex(FloorProfile const& profile, uint32_t k, uint32_t z, uint8_t index) {
+    assert(z <= UINT16_MAX);
+    return {
+        .pos = profile.slots_snorm[k],
+        .sector = static_cast<uint16_t>(z),
+        .color = index,
+        .pad = 0,
+    };
+}
+#else
+static LevelVtx MakeLevelVertex(FloorProfile const& profile, uint32_t k, uint32_t z, uint8_t index) {
+    return {{profile.slots[k][0], profile.slots[k][1], -(float)z}, sColorMap[index]};
+}
+#endif
+
+// Writes the vertex ring at the front of sector z (one vertex per slot corner, shared by adjacent tiles)
+// The ring vertex k is the provoking vertex of tile k of the sector, so it carries that tile's color
+static LevelVtx* GenerateRingVertices(SegmentGeometry const& geo, FloorProfile const& profile, TileGrid const& grid, uint32_t z, LevelVtx* meshptr) {
+    // The ring only differs from the profile in Z
+    auto const emit = [&](uint32_t k, uint8_t value) {
+        *meshptr++ = MakeLevelVertex(profile, k, z, value);
+    };
+    if (z < geo.sectors) {
+        grid.ForEachSectorSlot(z, emit);
+    } else {
+        // The back ring of the last sector has no tiles
+        for (uint32_t k = 0; k != geo.floors * geo.floor_planes; ++k)
+            emit(k, 0);
+    }
+    return meshptr;
+}
+
+// Writes the indices of sector z; every slot has a fixed block of 6 indices, empty slots are degenerate
+template <typename Index>
+static Index* GenerateSectorIndices(SegmentGeometry const& geo, TileGrid const& grid, uint32_t z, Index* idxptr) {
+    uint32_t const ring = geo.floors * geo.floor_planes;
+    Index const front = z * ring, back = (z + 1) * ring;
+
+    grid.ForEachSectorSlot(z, [&](uint32_t k, uint8_t value) {
+        Index const k1 = k + 1 == ring ? 0 : k + 1;
+        if (value == 0) {
+            std::fill_n(idxptr, 6, front + k);
+            idxptr += 6;
+            return;
+        }
+        // Both triangles end on the front-left corner (provoking vertex)
+        // Triangle 1
+        *idxptr++ = front + k1;
+        *idxptr++ = back + k1;
+        *idxptr++ = front + k;
+        // Triangle 2
+        *idxptr++ = back + k1;
+        *idxptr++ = back + k;
+        *idxptr++ = front + k;
+    });
+    return idxptr;
+}
+
+// Index type of the segment's mesh, 16-bit if all of its vertices can be addressed
+static uint32_t SegmentIndexType(SegmentGeometry const& geo) {
+    return (geo.sectors + 1) * geo.floors * geo.floor_planes <= 0x10000 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+}
+
+template <typename Index>
+static void BuildSectorIndices(SegmentGeometry const& geo, TileGrid const& grid, uint32_t begin, uint32_t end, std::vector<uint8_t>& out) {
+    size_t const sector_indices = 6 * geo.floors * geo.floor_planes;
+    out.resize(sizeof(Index) * sector_indices * (end - begin));
+    Index* idxptr = reinterpret_cast<Index*>(out.data());
+    for (uint32_t z = begin; z != end; ++z) {
+        idxptr = GenerateSectorIndices(geo, grid, z, idxptr);
+    }
+}
+
+static void BuildSectorIndices(SegmentGeometry const& geo, TileGrid const& grid, uint32_t begin, uint32_t end, std::vector<uint8_t>& out) {
+    if (SegmentIndexType(geo) == GL_UNSIGNED_SHORT) {
+        BuildSectorIndices<uint16_t>(geo, grid, begin, end, out);
+    } else {
+        BuildSectorIndices<uint32_t>(geo, grid, begin, end, out);
+    }
+}
+
+// Level-wide buffer, ranges of whole units are handed out to the segments
+struct BufferArena {
+    size_t unit; // Bytes
+    uint32_t buffer = 0;
+    size_t capacity = 0; // Units
+    std::map<size_t, size_t> free = {}; // First unit of each free range and its length
+};
+
+// Smallest arena size, in units
+static constexpr size_t cMinArenaUnits = 1 << 16;
+
+static struct {
+    BufferArena vertices {.unit = sizeof(LevelVtx)};
+    // Index ranges start at a 4-byte unit, so both index types are aligned
+    BufferArena indices {.unit = 4};
+    uint32_t vao = 0;
+} sMeshArena;
+
+static void SetupLevelMeshArray(uint32_t vbo);
+
+// Returns the range to the free list, merged with its free neighbours
+static void FreeRange(BufferArena& arena, size_t first, size_t count) {
+    if (!count)
+        return;
+    auto next = arena.free.lower_bound(first);
+    if (next != arena.free.end() and first + count == next->first) {
+        count += next->second;
+        next = arena.free.erase(next);
+    }
+    if (next != arena.free.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == first) {
+            prev->second += count;
+            return;
+        }
+    }
+    arena.free.emplace_hint(next, first, count);
+}
+
+// Moves the arena to a buffer at least twice as big, the contents are copied on the GPU
+static void GrowArena(BufferArena& arena, size_t min_count) {
+    size_t const capacity = std::max({arena.capacity * 2, arena.capacity + min_count, cMinArenaUnits});
+    uint32_t buffer;
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, arena.unit * capacity, nullptr, GL_DYNAMIC_DRAW);
+    if (arena.buffer) {
+        glBindBuffer(GL_COPY_READ_BUFFER, arena.buffer);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, arena.unit * arena.capacity);
+        glDeleteBuffers(1, &arena.buffer);
+    }
+    arena.buffer = buffer;
+    FreeRange(arena, arena.capacity, capacity - arena.capacity);
+    arena.capacity = capacity;
+
+    // The shared VAO still points to the old buffers
+    if (!sMeshArena.vao)
+        glGenVertexArrays(1, &sMeshArena.vao);
+    glBindVertexArray(sMeshArena.vao);
+    if (sMeshArena.vertices.buffer)
+        SetupLevelMeshArray(sMeshArena.vertices.buffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sMeshArena.indices.buffer);
+}
+
+// First fit, returns the first unit of the range
+static size_t AllocateRange(BufferArena& arena, size_t count) {
+    if (!count)
+        return 0;
+    auto it = std::find_if(arena.free.begin(), arena.free.end(), [&](auto const& range) { return range.second >= count; });
+    if (it == arena.free.end()) {
+        GrowArena(arena, count);
+        // The range at the end is the only one big enough
+        it = std::prev(arena.free.end());
+    }
+    size_t const first = it->first, left = it->second - count;
+    arena.free.erase(it);
+    if (left)
+        arena.free.emplace(first + count, left);
+    return first;
+}
+
+static size_t IndexUnits(size_t idx_count, uint32_t idx_type) {
+    return ((idx_type == GL_UNSIGNED_SHORT ? 2 : 4) * idx_count + 3) / 4;
+}
+
+static void FreeSegmentRanges(GeometrySegment& seg) {
+    FreeRange(sMeshArena.vertices, seg.gpu_base, seg.vtx_count);
+    FreeRange(sMeshArena.indices, seg.gpu_index_base, IndexUnits(seg.idx_count, seg.idx_type));
+    seg.vtx_count = seg.idx_count = 0;
+}
+
+void BuildSegmentMesh(SegmentGeometry const& geo, TileGrid const& grid, SegmentMeshData& mesh) {
+    uint32_t const ring = geo.floors * geo.floor_planes;
+    mesh.vertices.resize(sizeof(LevelVtx) * (geo.sectors + 1) * ring);
+    LevelVtx* meshptr = reinterpret_cast<LevelVtx*>(mesh.vertices.data()); // current vertex of mesh
+    FloorProfile const& profile = GetFloorProfile(geo);
+    for (uint32_t z = 0; z <= geo.sectors; ++z) {
+        meshptr = GenerateRingVertices(geo, profile, grid, z, meshptr);
+    }
+    BuildSectorIndices(geo, grid, 0, geo.sectors, mesh.indices);
+}
+
+void UploadSegmentMesh(GeometrySegment& seg, SegmentMeshData const& mesh) {
+    uint32_t const ring = seg.geo.floors * seg.geo.floor_planes;
+    size_t const vtx_count = (seg.geo.sectors + 1) * ring;
+    size_t const idx_count = 6 * seg.geo.sectors * ring;
+    uint32_t const idx_type = SegmentIndexType(seg.geo);
+
+    // The ranges are kept if the mesh has the same size
+    if (vtx_count != seg.vtx_count or IndexUnits(idx_count, idx_type) != IndexUnits(seg.idx_count, seg.idx_type)) {
+        FreeSegmentRanges(seg);
+        seg.gpu_base = AllocateRange(sMeshArena.vertices, vtx_count);
+        seg.gpu_index_base = AllocateRange(sMeshArena.indices, IndexUnits(idx_count, idx_type));
+    }
+    seg.vtx_count = vtx_count;
+    seg.idx_count = idx_count;
+    seg.idx_type = idx_type;
+
+    // Through the copy target, so the element buffer binding of the VAO stays untouched
+    if (!mesh.vertices.empty()) {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, sMeshArena.vertices.buffer);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, sMeshArena.vertices.unit * seg.gpu_base, mesh.vertices.size(), mesh.vertices.data());
+    }
+    if (!mesh.indices.empty()) {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, sMeshArena.indices.buffer);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, sMeshArena.indices.unit * seg.gpu_index_base, mesh.indices.size(), mesh.indices.data());
+    }
+    seg.mesh_sectors = seg.geo.sectors;
+    seg.dirty_begin = seg.dirty_end = 0;
+}
+
+void UpdateLevelSceneModel(GeometrySegment& seg) {
+    ProfileScope scope("UpdateLevelSceneModel");
+    if (seg.mesh_sectors != seg.geo.sectors) {
+        // Sector layout changed, the slot offsets are no longer valid
+        GenerateLevelSceneModel(seg);
+        return;
+    }
+    if (seg.dirty_begin == seg.dirty_end)
+        return;
+
+    // A sector owns the colors of its front ring and its block of indices
+    uint32_t const ring = seg.geo.floors * seg.geo.floor_planes;
+    size_t const num_vertices = ring * (seg.dirty_end - seg.dirty_begin);
+    auto meshbuf = std::unique_ptr<LevelVtx[]>(new LevelVtx[num_vertices]);
+    LevelVtx* meshptr = meshbuf.get();
+    FloorProfile const& profile = GetFloorProfile(seg.geo);
+    for (uint32_t z = seg.dirty_begin; z != seg.dirty_end; ++z) {
+        meshptr = GenerateRingVertices(seg.geo, profile, seg.grid, z, meshptr);
+    }
+    std::vector<uint8_t> idxbuf;
+    BuildSectorIndices(seg.geo, seg.grid, seg.dirty_begin, seg.dirty_end, idxbuf);
+
+    // Patch only the affected sectors in place
+    glBindBuffer(GL_COPY_WRITE_BUFFER, sMeshArena.vertices.buffer);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, sizeof(LevelVtx) * (seg.gpu_base + ring * seg.dirty_begin), sizeof(LevelVtx) * num_vertices, meshbuf.get());
+    glBindBuffer(GL_COPY_WRITE_BUFFER, sMeshArena.indices.buffer);
+    size_t const idx_size = seg.idx_type == GL_UNSIGNED_SHORT ? 2 : 4;
+    glBufferSubData(GL_COPY_WRITE_BUFFER, sMeshArena.indices.unit * seg.gpu_index_base + idx_size * 6 * ring * seg.dirty_begin, idxbuf.size(), idxbuf.data());
+    seg.dirty_begin = seg.dirty_end = 0;
+}
+
+void PrintLevelMeshStats(LevelInfo const& level) {
+    size_t vtx_bytes = 0, idx_bytes = 0, flat_bytes = 0;
+    for (auto& seg : level.segments) {
+        vtx_bytes += sizeof(LevelVtx) * seg->vtx_count;
+        idx_bytes += (seg->idx_type == GL_UNSIGNED_SHORT ? 2 : 4) * seg->idx_count;
+        // Unindexed float layout would store each of the 6 vertices of a tile
+        flat_bytes += sizeof(Vtx) * seg->idx_count;
+    }
+    std::printf("Level mesh: %zu vertex bytes + %zu index bytes (unindexed: %zu bytes), buffers of %zu + %zu bytes\n", vtx_bytes, idx_bytes, flat_bytes,
+        sMeshArena.vertices.unit * sMeshArena.vertices.capacity, sMeshArena.indices.unit * sMeshArena.indices.capacity);
+}
+
+static void SetupLevelMeshArray(uint32_t vbo) {
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+#ifdef RUN_PACKED_VERTICES
+    // Attribute 1 (vColor) stays disabled, the color comes from the palette
+    glVertexAttribPointer(0, 2, GL_SHORT, true, sizeof(LevelVtx), reinterpret_cast<const void*>(offsetof(LevelVtx, pos)));
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(2, 1, GL_UNSIGNED_SHORT, false, sizeof(LevelVtx), reinterpret_cast<const void*>(offsetof(LevelVtx, sector)));
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(3, 1, GL_UNSIGNED_BYTE, false, sizeof(LevelVtx), reinterpret_cast<const void*>(offsetof(LevelVtx, color)));
+    glEnableVertexAttribArray(3);
+#else
+    glVertexAttribPointer(0, 3, GL_FLOAT, false, sizeof(Vtx), reinterpret_cast<const void*>(offsetof(Vtx, pos)));
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 3, GL_FLOAT, false, sizeof(Vtx), reinterpret_cast<const void*>(offsetof(Vtx, col)));
+    glEnableVertexAttribArray(1);
+#endif
+}
+
+// The ranges are allocated on upload, the arena buffers are created on first use
+void SetupSegmentBuffers(GeometrySegment& seg) {
+    seg.gpu_ready = true;
+}
+
+void ReleaseSegmentBuffers(GeometrySegment& seg) {
+    // Never set up (headless tools and the main thread's level have no GL context)
+    if (!seg.gpu_ready)
+        return;
+    // Streamed segments may be set up again later
+    FreeSegmentRanges(seg);
+    seg.gpu_ready = false;
+}
+
+void InitLevelRenderer(BasicShader const& shader) {
+    glUseProgram(shader.prog);
+    UploadLevelPalette(shader.loc_uPalette);
+}
+
+void FinishLevelRenderer() {
+    glDeleteVertexArrays(1, &sMeshArena.vao);
+    glDeleteBuffers(1, &sMeshArena.vertices.buffer);
+    glDeleteBuffers(1, &sMeshArena.indices.buffer);
+    for (BufferArena* arena : {&sMeshArena.vertices, &sMeshArena.indices}) {
+        arena->buffer = 0;
+        arena->capacity = 0;
+        arena->free.clear();
+    }
+    sMeshArena.vao = 0;
+}
+
+void RenderLevel(BasicShader const& shader, LevelInfo const& level, float curZ, uint32_t skip_begin, uint32_t skip_end) {
+    GpuProfileScope scope("RenderLevel");
+    glUniform3f(shader.loc_uScale, 1.f, 1.f, sLevelZScale);
+    glUniform1i(shader.loc_uUsePalette, cLevelUsesPalette);
+    auto const window = GetVisibleSectors(level, curZ);
+    glBindVertexArray(sMeshArena.vao);
+    for (uint32_t idx = FindSegment(level, window.begin); idx < level.segments.size() and level.sector_offsets[idx] < window.end; ++idx) {
+        auto const& seg = *level.segments[idx];
+        uint32_t const offset = level.sector_offsets[idx];
+        uint32_t const first = std::max(window.begin, offset) - offset;
+        uint32_t const last = std::min(window.end, offset + seg.geo.sectors) - offset;
+        if ((skip_begin <= idx and idx < skip_end) or !seg.resident or !seg.idx_count or first >= last)
+            continue;
+        // Each sector owns a fixed block of indices
+        size_t const sector_indices = 6 * seg.geo.floors * seg.geo.floor_planes;
+        size_t const idx_size = seg.idx_type == GL_UNSIGNED_SHORT ? 2 : 4;
+        glUniform3f(shader.loc_uDisplacement, 0.f, 0.f, curZ - sLevelZScale * offset);
+        size_t const idx_offset = sMeshArena.indices.unit * seg.gpu_index_base + idx_size * sector_indices * first;
+        glDrawElementsBaseVertex(GL_TRIANGLES, sector_indices * (last - first), seg.idx_type, reinterpret_cast<const void*>(idx_offset), seg.gpu_base);
+    }
+    glUniform1i(shader.loc_uUsePalette, false);
+}
@@ -0,0 +1,131 @@
+#include "render.hpp"
+
+#include <cstdio>
+
+// Procedural renderer: the CPU only uploads the packed slot bits of each segment,
+// the tiles are generated in level_procedural.vs.glsl
+
+static struct {
+    uint32_t prog;
+    uint32_t vao; // No attributes, but core profile needs a VAO to draw
+    int32_t loc_uFirstSlot;
+    int32_t loc_uGeometry;
+    int32_t loc_uScale;
+    int32_t loc_uDisplacement;
+} sRenderer;
+
+static size_t SlotPlaneSize(GeometrySegment const& seg) {
+    size_t const num_slots = seg.geo.floors * seg.geo.floor_planes * seg.geo.sectors;
+    return (num_slots + 7) / 8;
+}
+
+void InitLevelRenderer(BasicShader const& shader) {
+    uint32_t vs = LoadShaderFromFile("level_procedural.vs.glsl", GL_VERTEX_SHADER);
+    uint32_t fs = LoadShaderFromFile("basic.fs.glsl", GL_FRAGMENT_SHADER);
+
+    uint32_t prog = glCreateProgram();
+    glAttachShader(prog, vs);
+    glAttachShader(prog, fs);
+    glLinkProgram(prog);
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+
+    sRenderer.prog = prog;
+    sRenderer.loc_uFirstSlot = glGetUniformLocation(prog, "uFirstSlot");
+    sRenderer.loc_uGeometry = glGetUniformLocation(prog, "uGeometry");
+    sRenderer.loc_uScale = glGetUniformLocation(prog, "uScale");
+    sRenderer.loc_uDisplacement = glGetUniformLocation(prog, "uDisplacement");
+
+    glUseProgram(prog);
+    glUniform1i(glGetUniformLocation(prog, "uSlots"), 0);
+    UploadLevelPalette(glGetUniformLocation(prog, "uPalette"));
+    glUseProgram(shader.prog);
+
+    glGenVertexArrays(1, &sRenderer.vao);
+}
+
+void FinishLevelRenderer() {
+    glDeleteVertexArrays(1, &sRenderer.vao);
+    glDeleteProgram(sRenderer.prog);
+}
+
+void SetupSegmentBuffers(GeometrySegment& seg) {
+    glGenBuffers(1, &seg.gl_vbo);
+    glGenTextures(1, &seg.gl_tex);
+    seg.gpu_ready = true;
+}
+
+void ReleaseSegmentBuffers(GeometrySegment& seg) {
+    // Never set up (headless tools and the main thread's level have no GL context)
+    if (!seg.gpu_ready)
+        return;
+    glDeleteTextures(1, &seg.gl_tex);
+    glDeleteBuffers(1, &seg.gl_vbo);
+    // Streamed segments may be set up again later
+    seg.gl_tex = seg.gl_vbo = 0;
+    seg.gpu_ready = false;
+}
+
+// Nothing to build, the grid planes are uploaded as they are
+void BuildSegmentMesh(SegmentGeometry const&, TileGrid const&, SegmentMeshData&) {}
+
+void UploadSegmentMesh(GeometrySegment& seg, SegmentMeshData const&) {
+    // The presence plane is uploaded as-is
+    glBindBuffer(GL_TEXTURE_BUFFER, seg.gl_vbo);
+    glBufferData(GL_TEXTURE_BUFFER, SlotPlaneSize(seg), seg.grid.PresenceBytes(), GL_DYNAMIC_DRAW);
+    glBindTexture(GL_TEXTURE_BUFFER, seg.gl_tex);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_R8UI, seg.gl_vbo);
+    seg.mesh_sectors = seg.geo.sectors;
+    seg.dirty_begin = seg.dirty_end = 0;
+}
+
+void UpdateLevelSceneModel(GeometrySegment& seg) {
+    ProfileScope scope("UpdateLevelSceneModel");
+    if (seg.mesh_sectors != seg.geo.sectors) {
+        GenerateLevelSceneModel(seg);
+        return;
+    }
+    if (seg.dirty_begin == seg.dirty_end)
+        return;
+
+    // Only the bytes covering the dirty sectors are re-uploaded (usually a single byte)
+    uint32_t const ring = seg.geo.floors * seg.geo.floor_planes;
+    size_t const begin = seg.dirty_begin * ring / 8;
+    size_t const end = (seg.dirty_end * ring + 7) / 8;
+
+    glBindBuffer(GL_TEXTURE_BUFFER, seg.gl_vbo);
+    glBufferSubData(GL_TEXTURE_BUFFER, begin, end - begin, seg.grid.PresenceBytes() + begin);
+    seg.dirty_begin = seg.dirty_end = 0;
+}
+
+void PrintLevelMeshStats(LevelInfo const& level) {
+    size_t slot_bytes = 0;
+    for (auto& seg : level.segments) {
+        slot_bytes += SlotPlaneSize(*seg);
+    }
+    std::printf("Level slot buffers: %zu bytes\n", slot_bytes);
+}
+
+void RenderLevel(BasicShader const& shader, LevelInfo const& level, float curZ, uint32_t skip_begin, uint32_t skip_end) {
+    GpuProfileScope scope("RenderLevel");
+    glUseProgram(sRenderer.prog);
+    glBindVertexArray(sRenderer.vao);
+    glActiveTexture(GL_TEXTURE0);
+    glUniform3f(sRenderer.loc_uScale, 1.f, 1.f, sLevelZScale);
+    auto const window = GetVisibleSectors(level, curZ);
+    for (uint32_t idx = FindSegment(level, window.begin); idx < level.segments.size() and level.sector_offsets[idx] < window.end; ++idx) {
+        auto const& seg = *level.segments[idx];
+        uint32_t const offset = level.sector_offsets[idx];
+        uint32_t const first = std::max(window.begin, offset) - offset;
+        uint32_t const last = std::min(window.end, offset + seg.geo.sectors) - offset;
+        uint32_t const ring = seg.geo.floors * seg.geo.floor_planes;
+        if ((skip_begin <= idx and idx < skip_end) or !seg.resident or first >= last or ring == 0)
+            continue;
+        glUniform3f(sRenderer.loc_uDisplacement, 0.f, 0.f, curZ - sLevelZScale * offset);
+        glUniform2i(sRenderer.loc_uGeometry, seg.geo.floors, seg.geo.floor_planes);
+        glUniform1i(sRenderer.loc_uFirstSlot, ring * first);
+        glBindTexture(GL_TEXTURE_BUFFER, seg.gl_tex);
+        glDrawArraysInstanced(GL_TRIANGLES, 0, 6, ring * (last - first));
+    }
+    glUseProgram(shader.prog);
+}
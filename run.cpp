@@ -1,19 +1,34 @@
 #include "run.hpp"
+#include "render.hpp"
+#include "thread_pool.hpp"
 
 //#include <cassert>
 #include <cstring>
 #include <cmath>
 #include <cstdio>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <bit>
 
 #include <GL/glew.h>
 
-inline double const C_PI = std::acos(-1);
+uint64_t NewSegmentSerial() {
+    static std::atomic<uint64_t> sNextSerial = 1;
+    return sNextSerial.fetch_add(1, std::memory_order_relaxed);
+}
 
 GeometrySegment::~GeometrySegment() {
-    glDeleteVertexArrays(1, &gl_vao);
-    glDeleteBuffers(1, &gl_vbo);
+    ReleaseSegmentBuffers(*this);
 }
 
+// Appends a segment of a level file, as a run of chunks if it's long
+static void AddSegmentChunks(LevelInfo& level, SegmentGeometry const& geo, TileGrid& grid);
+// Replaces the segments of the level with the chunks of the file's segments, none of them resident
+static void AttachLevelStream(LevelInfo& level, std::shared_ptr<LevelStreamFile const> file);
+
 LevelInfo LoadBlankLevel() {
     LevelInfo info;
 
@@ -22,102 +37,171 @@ LevelInfo LoadBlankLevel() {
     seg.geo.floors = 4;
     seg.geo.floor_planes = 5;
     seg.geo.sectors = 3;
-    seg.data.resize(seg.geo.floors * seg.geo.floor_planes * seg.geo.sectors, 1);
+    seg.grid.Reset(seg.geo.floors * seg.geo.floor_planes, seg.geo.sectors, true);
     GetFloorProperties(seg);
+    UpdateSectorOffsets(info);
+    return info;
+}
+
+LevelInfo LoadLevelFromArray(size_t num_sectors, uint8_t const* data) {
+    LevelInfo info;
+
+    SegmentGeometry const geo = {4, 5, static_cast<uint32_t>(num_sectors)};
+    TileGrid grid;
+    grid.AssignBytes(geo.floors * geo.floor_planes, geo.sectors, data);
+    AddSegmentChunks(info, geo, grid);
+    UpdateSectorOffsets(info);
     return info;
 }
 
 void CleanupLevel(LevelInfo& level) {
+    level.stream.reset();
     level.segments.clear();
     level.segments.shrink_to_fit();
+    level.sector_offsets.clear();
+    // Unmapped once no segment references it
+    level.mapping.reset();
+}
+
+void UpdateSectorOffsets(LevelInfo& level) {
+    level.sector_offsets.resize(level.segments.size() + 1);
+    uint32_t offset = 0;
+    for (size_t idx = 0; idx != level.segments.size(); ++idx) {
+        level.sector_offsets[idx] = offset;
+        offset += level.segments[idx]->geo.sectors;
+    }
+    level.sector_offsets.back() = offset;
+    level.layout_changed = true;
+}
+
+uint32_t FindSegment(LevelInfo const& level, uint32_t sector) {
+    auto const begin = level.sector_offsets.begin(), end = level.sector_offsets.end() - 1;
+    auto const it = std::upper_bound(begin, end, sector);
+    return it == begin ? 0 : (it - begin) - 1;
+}
+
+uint32_t SegmentRunBegin(LevelInfo const& level, uint32_t segment) {
+    while (level.segments[segment]->joined)
+        --segment;
+    return segment;
 }
 
-static Col const sColorMap[] = {
+uint32_t SegmentRunEnd(LevelInfo const& level, uint32_t segment) {
+    do {
+        ++segment;
+    } while (segment < level.segments.size() and level.segments[segment]->joined);
+    return segment;
+}
+
+void RebalanceChunk(LevelInfo& level, uint32_t& segment, uint32_t& sector) {
+    auto& segments = level.segments;
+    GeometrySegment& seg = *segments[segment];
+    if (seg.geo.sectors > cMaxChunkSectors) {
+        uint32_t const at = seg.geo.sectors / 2;
+        GeometrySegment& tail = **segments.emplace(segments.begin() + segment + 1, new GeometrySegment);
+        tail.geo = seg.geo;
+        tail.geo.sectors = seg.geo.sectors - at;
+        tail.joined = true;
+        seg.grid.SplitSectors(at, tail.grid);
+        seg.geo.sectors = at;
+        GetFloorProperties(tail);
+        MarkSegmentChanged(seg);
+        if (sector >= at) {
+            ++segment;
+            sector -= at;
+        }
+        return;
+    }
+    if (seg.geo.sectors >= cMinChunkSectors)
+        return;
+    uint32_t first;
+    if (seg.joined)
+        first = segment - 1;
+    else if (segment + 1 < segments.size() and segments[segment + 1]->joined)
+        first = segment;
+    else
+        return; // A segment of its own
+    GeometrySegment& head = *segments[first];
+    uint32_t const head_sectors = head.geo.sectors;
+    head.grid.AppendSectors(segments[first + 1]->grid);
+    head.geo.sectors += segments[first + 1]->geo.sectors;
+    segments.erase(segments.begin() + first + 1);
+    MarkSegmentChanged(head);
+    if (segment != first) {
+        segment = first;
+        sector += head_sectors;
+    }
+    // Split again if the neighbour was long
+    RebalanceChunk(level, segment, sector);
+}
+
+Col const sColorMap[4] = {
     {0., 0., 0.}, // empty (skipped)
     {1., 1., 1.}, // present (normal)
-    {.2, .2, .2}, // selected (empty)
-    {0., 1., 0.}, // selected (present)
+    {.2, .2, .2}, // cursor (empty)
+    {0., 1., 0.}, // cursor (present)
 };
 
-void GenerateLevelSceneModel(GeometrySegment& seg) {
-    glBindBuffer(GL_ARRAY_BUFFER, seg.gl_vbo);
-
-    auto meshbuf = std::unique_ptr<float[]>(new float[2 * 18 * seg.geo.sectors * seg.geo.floors * seg.geo.floor_planes]);
-    float* meshptr = meshbuf.get(); // current XYZ vertex of mesh
-    uint8_t const* cursor = seg.data.data();
-
-    for (size_t z = 0; z < seg.geo.sectors; ++z) {
-        // Generate mesh of quads
-        // First floor must be flat horizontal, so phase offset is phi/2
-        // where phi = 2pi/num_floors
-        double const phi = 2*C_PI / seg.geo.floors;
-        for (uint32_t i = 0; i < seg.geo.floors; ++i) {
-            double const angle = i*phi;
-            float xl, yl, xr, yr; // XY pos of left/right corners
-            xl =  std::sin(angle - phi/2);
-            yl = -std::cos(angle - phi/2);
-            xr =  std::sin(angle + phi/2);
-            yr = -std::cos(angle + phi/2);
-
-            for (uint32_t j = 0; j < seg.geo.floor_planes; ++j) {
-                uint8_t index = *cursor++;
-                if (index == 0)
-                    continue;
-                Col color = sColorMap[index];
-                // Interpolate the vertices
-                // XY = lerp(XY0, XY1, j/num_floor_planes)
-                float xp0, yp0, xp1, yp1;
-                float const j0 = j, j1 = j + 1;
-                xp0 = xl + (j0/seg.geo.floor_planes) * (xr - xl);
-                yp0 = yl + (j0/seg.geo.floor_planes) * (yr - yl);
-                xp1 = xl + (j1/seg.geo.floor_planes) * (xr - xl);
-                yp1 = yl + (j1/seg.geo.floor_planes) * (yr - yl);
-
-                // Append quad to the mesh (for now without element buffer; 36 floats per plane)
-                #define SET_COLOR \
-                *meshptr++ = color[0];\
-                *meshptr++ = color[1];\
-                *meshptr++ = color[2];
-
-                // Triangle 1
-                *meshptr++ = xp0;
-                *meshptr++ = yp0;
-                *meshptr++ = -(float)z;
-                SET_COLOR
-
-                *meshptr++ = xp1;
-                *meshptr++ = yp1;
-                *meshptr++ = -(float)z;
-                SET_COLOR
-
-                *meshptr++ = xp1;
-                *meshptr++ = yp1;
-                *meshptr++ = -(float)z-1.f;
-                SET_COLOR
-
-                // Triangle 2
-                *meshptr++ = xp1;
-                *meshptr++ = yp1;
-                *meshptr++ = -(float)z-1.f;
-                SET_COLOR
-
-                *meshptr++ = xp0;
-                *meshptr++ = yp0;
-                *meshptr++ = -(float)z-1.f;
-                SET_COLOR
-
-                *meshptr++ = xp0;
-                *meshptr++ = yp0;
-                *meshptr++ = -(float)z;
-                SET_COLOR
-                #undef SET_COLOR
-            }
+void MarkSegmentDirty(GeometrySegment& seg, uint32_t sector) {
+    if (seg.dirty_begin == seg.dirty_end) {
+        seg.dirty_begin = sector;
+        seg.dirty_end = sector + 1;
+    } else {
+        seg.dirty_begin = std::min(seg.dirty_begin, sector);
+        seg.dirty_end = std::max(seg.dirty_end, sector + 1);
+    }
+}
+
+void MarkSegmentChanged(GeometrySegment& seg) {
+    seg.dirty_begin = 0;
+    // Never empty, so the change is noticed even without sectors
+    seg.dirty_end = std::max(seg.geo.sectors, 1u);
+}
+
+static FloorProfile MakeFloorProfile(uint32_t floors, uint32_t floor_planes) {
+    FloorProfile profile;
+    // First floor must be flat horizontal, so phase offset is phi/2
+    // where phi = 2pi/num_floors
+    double const phi = 2*C_PI / floors;
+    profile.floors.resize(floors);
+    profile.slots.reserve(floors * floor_planes);
+    for (uint32_t floor = 0; floor != floors; ++floor) {
+        double const angle = floor*phi;
+        auto& [xl, yl, xr, yr] = profile.floors[floor];
+        xl =  std::sin(angle - phi/2);
+        yl = -std::cos(angle - phi/2);
+        xr =  std::sin(angle + phi/2);
+        yr = -std::cos(angle + phi/2);
+        // The right corner of the floor is the left corner of the next one
+        // Interpolate the vertices
+        // XY = lerp(XY0, XY1, j/num_floor_planes)
+        for (uint32_t part = 0; part != floor_planes; ++part) {
+            float const p0 = part;
+            profile.slots.push_back({
+                xl + (p0/floor_planes) * (xr - xl),
+                yl + (p0/floor_planes) * (yr - yl),
+            });
         }
     }
+    for (auto const [x, y] : profile.slots)
+        profile.slots_snorm.push_back({static_cast<int16_t>(std::lround(x * 0x7FFF)), static_cast<int16_t>(std::lround(y * 0x7FFF))});
+    profile.yval = -std::cos(phi/2);
+    profile.xmax =  std::sin(phi/2);
+    profile.xmin = -profile.xmax;
+    profile.pwidth = 2*profile.xmax / floor_planes;
+    return profile;
+}
 
-    // Upload mesh data
-    seg.vtx_count = (meshptr - meshbuf.get()) / (2 * 3);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(float) * seg.vtx_count * 2 * 3, meshbuf.get(), GL_DYNAMIC_DRAW);
+FloorProfile const& GetFloorProfile(SegmentGeometry const& geo) {
+    // Levels only use a handful of geometries, so the profiles are never freed
+    static std::mutex sLock;
+    static std::map<std::pair<uint32_t, uint32_t>, FloorProfile> sProfiles;
+    std::lock_guard guard(sLock);
+    auto const key = std::make_pair(geo.floors, geo.floor_planes);
+    auto it = sProfiles.find(key);
+    if (it == sProfiles.end())
+        it = sProfiles.emplace(key, MakeFloorProfile(geo.floors, geo.floor_planes)).first;
+    return it->second;
 }
 
 void GenerateSegmentSelectionModel(SegmentGeometry const& geo) {
@@ -125,14 +209,9 @@ void GenerateSegmentSelectionModel(SegmentGeometry const& geo) {
     auto meshbuf = std::unique_ptr<float[]>(new float[vtx_count * 2 * 3]);
     float* meshptr = meshbuf.get();
 
-    double const phi = 2*C_PI / geo.floors;
+    FloorProfile const& profile = GetFloorProfile(geo);
     for (uint32_t floor = 0; floor != geo.floors; ++floor) {
-        double const angle = floor*phi;
-        float xl, yl, xr, yr; // XY pos of left/right corners
-        xl =  std::sin(angle - phi/2);
-        yl = -std::cos(angle - phi/2);
-        xr =  std::sin(angle + phi/2);
-        yr = -std::cos(angle + phi/2);
+        auto const& [xl, yl, xr, yr] = profile.floors[floor];
 
         // Triangle 1
         *meshptr++ = xl;
@@ -183,6 +262,32 @@ void GenerateSegmentSelectionModel(SegmentGeometry const& geo) {
     glBufferData(GL_ARRAY_BUFFER, sizeof(float) * vtx_count * 2 * 3, meshbuf.get(), GL_DYNAMIC_DRAW);
 }
 
+void GenerateSectorCursorModel(SegmentGeometry const& geo) {
+    uint32_t const ring = geo.floors * geo.floor_planes;
+    std::vector<Vtx> mesh;
+    mesh.reserve(2 * 6 * ring);
+
+    // Same triangles as a tile of the level model
+    FloorProfile const& profile = GetFloorProfile(geo);
+    for (uint8_t const index : {2, 3}) {
+        Col const& col = sColorMap[index];
+        for (uint32_t k = 0; k != ring; ++k) {
+            auto const& [x0, y0] = profile.slots[k];
+            auto const& [x1, y1] = profile.slots[k + 1 == ring ? 0 : k + 1];
+            // Triangle 1
+            mesh.push_back({{x1, y1, 0.f}, col});
+            mesh.push_back({{x1, y1, -1.f}, col});
+            mesh.push_back({{x0, y0, 0.f}, col});
+            // Triangle 2
+            mesh.push_back({{x1, y1, -1.f}, col});
+            mesh.push_back({{x0, y0, -1.f}, col});
+            mesh.push_back({{x0, y0, 0.f}, col});
+        }
+    }
+
+    glBufferData(GL_ARRAY_BUFFER, sizeof(Vtx) * mesh.size(), mesh.data(), GL_DYNAMIC_DRAW);
+}
+
 static constexpr Col cMeshOutlineColor = {0.8, 0.4, 0.2};
 
 #define SET_COLOR \
@@ -196,14 +301,9 @@ void GenerateSegmentOutlineModel(SegmentGeometry const& geo) {
     auto meshbuf = std::unique_ptr<float[]>(new float[line_count * 2 * 3 * 2]);
     float* meshptr = meshbuf.get();
 
-    double const phi = 2*C_PI / geo.floors;
+    FloorProfile const& profile = GetFloorProfile(geo);
     for (uint32_t floor = 0; floor != geo.floors; ++floor) {
-        double const angle = floor*phi;
-        float xl, yl, xr, yr; // XY pos of left/right corners
-        xl =  std::sin(angle - phi/2);
-        yl = -std::cos(angle - phi/2);
-        xr =  std::sin(angle + phi/2);
-        yr = -std::cos(angle + phi/2);
+        auto const& [xl, yl, xr, yr] = profile.floors[floor];
 
         // Front line
         *meshptr++ = xl;
@@ -249,14 +349,9 @@ void GenerateSegmentSectorWireModel(SegmentGeometry const& geo) {
     auto meshbuf = std::unique_ptr<float[]>(new float[line_count * 2 * 3 * 2]);
     float* meshptr = meshbuf.get();
 
-    double const phi = 2*C_PI / geo.floors;
+    FloorProfile const& profile = GetFloorProfile(geo);
     for (uint32_t floor = 0; floor != geo.floors; ++floor) {
-        double const angle = floor*phi;
-        float xl, yl, xr, yr; // XY pos of left/right corners
-        xl =  std::sin(angle - phi/2);
-        yl = -std::cos(angle - phi/2);
-        xr =  std::sin(angle + phi/2);
-        yr = -std::cos(angle + phi/2);
+        auto const& [xl, yl, xr, yr] = profile.floors[floor];
 
         // Side line
         *meshptr++ = xl;
@@ -293,22 +388,13 @@ void GenerateSegmentSlotWireModel(SegmentGeometry const& geo) {
     auto meshbuf = std::unique_ptr<float[]>(new float[line_count * 2 * 3 * 2]);
     float* meshptr = meshbuf.get();
 
-    double const phi = 2*C_PI / geo.floors;
+    FloorProfile const& profile = GetFloorProfile(geo);
     for (uint32_t floor = 0; floor != geo.floors; ++floor) {
-        double const angle = floor*phi;
-        float xl, yl, xr, yr; // XY pos of left/right corners
-        xl =  std::sin(angle - phi/2);
-        yl = -std::cos(angle - phi/2);
-        xr =  std::sin(angle + phi/2);
-        yr = -std::cos(angle + phi/2);
+        auto const& [xl, yl, xr, yr] = profile.floors[floor];
 
         // Side/floor plane lines
         for (uint32_t part = 0; part < geo.floor_planes; ++part) {
-            // Interpolate the vertices
-            // XY = lerp(XY0, XY1, j/num_floor_planes)
-            float const p0 = part;
-            float const xp = xl + (p0/geo.floor_planes) * (xr - xl);
-            float const yp = yl + (p0/geo.floor_planes) * (yr - yl);
+            auto const [xp, yp] = profile.slots[floor * geo.floor_planes + part];
 
             *meshptr++ = xp;
             *meshptr++ = yp;
@@ -342,11 +428,48 @@ void GenerateSegmentSlotWireModel(SegmentGeometry const& geo) {
 #undef SET_COLOR
 
 void GetFloorProperties(GeometrySegment& seg) {
-    double const phi = C_PI / seg.geo.floors;
-    seg.yval = -std::cos(phi);
-    seg.xmax =  std::sin(phi);
-    seg.xmin = -seg.xmax;
-    seg.pwidth = 2*seg.xmax / seg.geo.floor_planes;
+    FloorProfile const& profile = GetFloorProfile(seg.geo);
+    seg.yval = profile.yval;
+    seg.xmax = profile.xmax;
+    seg.xmin = profile.xmin;
+    seg.pwidth = profile.pwidth;
+}
+
+void StepPlayer(PlayerSim& sim) {
+    sim.prevZ = sim.curZ;
+    sim.curZ += sim.speed * static_cast<float>(cSimStep);
+}
+
+bool LocateSector(LevelInfo const& level, float z, SectorLocation& loc, uint32_t hint) {
+    float const sector = std::floor(z / sLevelZScale);
+    if (!(sector >= 0.f and sector < level.sector_offsets.back()))
+        return false;
+    loc.level_sector = static_cast<uint32_t>(sector);
+    // Consecutive steps mostly stay in the same segment
+    bool const in_hint = hint < level.segments.size()
+        and level.sector_offsets[hint] <= loc.level_sector and loc.level_sector < level.sector_offsets[hint + 1];
+    loc.segment = in_hint ? hint : FindSegment(level, loc.level_sector);
+    loc.sector = loc.level_sector - level.sector_offsets[loc.segment];
+    return true;
+}
+
+bool IsTilePresent(LevelInfo const& level, SectorLocation const& loc, uint32_t floor, uint32_t plane, uint32_t rotation) {
+    GeometrySegment const& seg = *level.segments[loc.segment];
+    // Also covers segments without planes, the level file allows both
+    if (!seg.geo.floors or plane >= seg.geo.floor_planes)
+        return false;
+    // Segments may have different floor counts, so the rotation is applied per segment
+    uint32_t const ring_floor = (floor + rotation) % seg.geo.floors;
+    return seg.grid.Present(size_t(loc.sector) * seg.grid.Ring() + ring_floor * seg.geo.floor_planes + plane);
+}
+
+bool IsPlayerSupported(LevelInfo const& level, SectorLocation const& loc, uint32_t rotation) {
+    uint32_t const planes = level.segments[loc.segment]->geo.floor_planes;
+    if (planes == 0)
+        return false;
+    if (planes % 2)
+        return IsTilePresent(level, loc, 0, planes / 2, rotation);
+    return IsTilePresent(level, loc, 0, planes / 2 - 1, rotation) or IsTilePresent(level, loc, 0, planes / 2, rotation);
 }
 
 void GenerateCharacterModel(uint32_t vbo) {
@@ -361,74 +484,743 @@ void GenerateCharacterModel(uint32_t vbo) {
     glBufferData(GL_ARRAY_BUFFER, sizeof(sModel), sModel, GL_STATIC_DRAW);
 }
 
-void SetupSegmentBuffers(GeometrySegment& seg) {
-    glGenVertexArrays(1, &seg.gl_vao);
-    glGenBuffers(1, &seg.gl_vbo);
-    glBindVertexArray(seg.gl_vao);
-    SetupLevelMeshArray(seg.gl_vbo);
+uint32_t LoadShaderFromFile(char const* fname, GLenum type) {
+    auto src = ReadFile(fname, false);
+    uint32_t shader = glCreateShader(type);
+
+    char const* src_var = reinterpret_cast<char*>(src.data.get());
+    int32_t size = src.size;
+    glShaderSource(shader, 1, &src_var, &size);
+    glCompileShader(shader);
+
+    int32_t status;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+
+    if (!status) {
+        int32_t log_size;
+        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &log_size);
+
+        char* buf = reinterpret_cast<char*>(alloca(log_size));
+        glGetShaderInfoLog(shader, log_size, nullptr, buf);
+
+        std::printf("Error while compiling shader: %s\n", buf);
+    }
+
+    return shader;
 }
 
-void SetupLevelMeshArray(uint32_t vbo) {
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glVertexAttribPointer(0, 3, GL_FLOAT, false, sizeof(Vtx), reinterpret_cast<const void*>(offsetof(Vtx, pos)));
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, 3, GL_FLOAT, false, sizeof(Vtx), reinterpret_cast<const void*>(offsetof(Vtx, col)));
-    glEnableVertexAttribArray(1);
-}
-
-void DumpLevelToFile(LevelInfo const& level, char const* fname) {
-    std::FILE* file = std::fopen(fname, "wb");
-    uint32_t const lv_hdr = (leveldata_version << 0x10) | (level.segments.size() & 0xFFFF);
-    std::fwrite(&lv_hdr, sizeof(uint32_t), 1, file);
-    for (auto& seg_ : level.segments) {
-        GeometrySegment const& seg = *seg_;
-        uint32_t const seg_hdr =
-            (seg.geo.sectors & 0xFFFF) | ((seg.geo.floor_planes & 0xFF) << 0x10) | ((seg.geo.floors & 0xFF) << 0x18);
-        std::fwrite(&seg_hdr, sizeof(uint32_t), 1, file);
-        size_t const num_slots = seg.geo.floors * seg.geo.floor_planes * seg.geo.sectors;
-        size_t const buf_size = (num_slots + 7) / 8; // Pack the slots in bitarray, padded with 0s if necessary
-        uint8_t* buf = reinterpret_cast<uint8_t*>(alloca(buf_size));
-        memset(buf, 0, buf_size);
-        for (size_t s = 0; s < num_slots; ++s)
-            buf[s / 8] |= static_cast<bool>(seg.data[s] & 1) << (s & 7);
-        std::fwrite(buf, 1, buf_size, file);
-    }
-    std::fclose(file);
+void UploadLevelPalette(int32_t loc_uPalette) {
+    glUniform3fv(loc_uPalette, std::size(sColorMap), sColorMap[0].data());
 }
 
-bool LoadLevelFromFile(LevelInfo& level, char const* fname) {
-    std::FILE* file = std::fopen(fname, "rb");
+// Level file format
+// Version 2: u32 version << 16 | segment count
+//   Per segment: u32 floors << 24 | floor_planes << 16 | sectors, then the slot bitarray (LSB first)
+// Version 3: u32 version << 16, u32 segment count
+//   Per segment: u32 sectors, u16 floors, u16 floor_planes, u32 data size, u32 encoding, then the data
+//   Encoding 0: the slot bitarray, like version 2 (used when the entries would be larger)
+//   Encoding 1: one entry per sector
+//   Sector entry: varint tag = runs << 2 | raw << 1 | xor
+//     raw: the ring's bits follow as a bitarray
+//     otherwise: `runs` varint run lengths follow, alternating 0s and 1s starting with 0s,
+//     the rest of the ring continues with the next value
+//     xor: the decoded bits are XORed with the previous sector (0s before the first one)
+// Varints are LEB128
+
+using Word = TileGrid::Word;
+
+// Version 3 segment encodings
+static constexpr uint32_t cSegmentBitarray = 0;
+static constexpr uint32_t cSegmentEntries = 1;
+
+static size_t RingWords(uint32_t ring) {
+    return (ring + TileGrid::cWordBits - 1) / TileGrid::cWordBits;
+}
+
+static void PutVarint(std::vector<uint8_t>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value) | 0x80);
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+static bool GetVarint(uint8_t const*& cur, uint8_t const* end, uint64_t& value) {
+    value = 0;
+    for (unsigned shift = 0; cur != end and shift < 64; shift += 7) {
+        uint8_t const byte = *cur++;
+        value |= uint64_t(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// Returns the end of the run of value starting at bit pos
+static size_t FindRunEnd(Word const* row, size_t bits, size_t pos, bool value) {
+    while (pos < bits) {
+        // Bits different from value become 1
+        Word const diff = (row[pos / 64] ^ (value ? ~Word(0) : 0)) >> (pos % 64);
+        if (diff)
+            return std::min(bits, pos + std::countr_zero(diff));
+        pos = (pos / 64 + 1) * 64;
+    }
+    return bits;
+}
+
+// Encodes a sector entry with the runs of row, runs is scratch space
+static void EncodeRuns(Word const* row, size_t bits, bool xor_prev, std::vector<uint64_t>& runs, std::vector<uint8_t>& out) {
+    runs.clear();
+    bool value = false;
+    for (size_t pos = 0; pos < bits; value = !value) {
+        size_t const end = FindRunEnd(row, bits, pos, value);
+        runs.push_back(end - pos);
+        pos = end;
+    }
+    // The last run is implied
+    if (!runs.empty())
+        runs.pop_back();
+    PutVarint(out, runs.size() << 2 | xor_prev);
+    for (uint64_t run : runs)
+        PutVarint(out, run);
+}
+
+static void SetBits(Word* row, size_t begin, size_t end) {
+    for (size_t pos = begin; pos < end;) {
+        size_t const count = std::min<size_t>(64 - pos % 64, end - pos);
+        row[pos / 64] |= (count == 64 ? ~Word(0) : (Word(1) << count) - 1) << (pos % 64);
+        pos += count;
+    }
+}
+
+static void EncodeSegmentData(TileGrid const& grid, std::vector<uint8_t>& out) {
+    uint32_t const ring = grid.Ring();
+    if (ring == 0)
+        return;
+    size_t const words = RingWords(ring);
+    std::vector<Word> row(words), prev(words, 0), diff(words);
+    std::vector<uint8_t> plain, delta;
+    std::vector<uint64_t> runs;
+    for (uint32_t z = 0; z != grid.Sectors(); ++z) {
+        grid.ReadSector(z, row.data());
+        for (size_t w = 0; w != words; ++w)
+            diff[w] = row[w] ^ prev[w];
+        plain.clear();
+        delta.clear();
+        EncodeRuns(row.data(), ring, false, runs, plain);
+        EncodeRuns(diff.data(), ring, true, runs, delta);
+        auto const& best = delta.size() < plain.size() ? delta : plain;
+        size_t const raw_size = 1 + (ring + 7) / 8;
+        if (raw_size < best.size()) {
+            // Noisy sector
+            out.push_back(2);
+            auto const* bytes = reinterpret_cast<uint8_t const*>(row.data());
+            out.insert(out.end(), bytes, bytes + (ring + 7) / 8);
+        } else {
+            out.insert(out.end(), best.begin(), best.end());
+        }
+        row.swap(prev);
+    }
+}
+
+// Returns false if the data is corrupt
+static bool DecodeSegmentData(uint8_t const* data, size_t size, SegmentGeometry const& geo, TileGrid& grid) {
+    uint32_t const ring = geo.floors * geo.floor_planes;
+    grid.Reset(ring, geo.sectors, false);
+    if (ring == 0)
+        return size == 0;
+    size_t const words = RingWords(ring);
+    std::vector<Word> row(words), prev(words, 0);
+    uint8_t const* cur = data;
+    uint8_t const* const end = data + size;
+    for (uint32_t z = 0; z != geo.sectors; ++z) {
+        uint64_t tag;
+        if (!GetVarint(cur, end, tag))
+            return false;
+        std::fill(row.begin(), row.end(), 0);
+        if (tag & 2) {
+            size_t const bytes = (ring + 7) / 8;
+            if (size_t(end - cur) < bytes)
+                return false;
+            std::memcpy(row.data(), cur, bytes);
+            cur += bytes;
+            if (ring % 64)
+                row.back() &= (Word(1) << (ring % 64)) - 1;
+        } else {
+            size_t pos = 0;
+            bool value = false;
+            for (uint64_t run_idx = 0; run_idx != tag >> 2; ++run_idx, value = !value) {
+                uint64_t run;
+                if (!GetVarint(cur, end, run) or run > ring - pos)
+                    return false;
+                if (value)
+                    SetBits(row.data(), pos, pos + run);
+                pos += run;
+            }
+            if (value)
+                SetBits(row.data(), pos, ring);
+        }
+        if (tag & 1) {
+            for (size_t w = 0; w != words; ++w)
+                row[w] ^= prev[w];
+        }
+        grid.WriteSector(z, row.data());
+        row.swap(prev);
+    }
+    return cur == end;
+}
+
+bool DumpLevelToFile(LevelInfo const& level, char const* fname) {
+    // Write to a temporary file first, the old file may still be mapped by the level
+    std::string const tmp_name = std::string(fname) + ".tmp";
+    std::FILE* file = std::fopen(tmp_name.c_str(), "wb");
     if (!file) {
-        std::perror("Could not load level");
+        std::perror("Could not dump level");
+        return false;
+    }
+    uint32_t segments = 0;
+    for (uint32_t idx = 0; idx != level.segments.size(); idx = SegmentRunEnd(level, idx))
+        ++segments;
+    uint32_t const lv_hdr[2] = {uint32_t(leveldata_version) << 0x10, segments};
+    bool ok = std::fwrite(lv_hdr, sizeof(uint32_t), 2, file) == 2;
+    std::vector<uint8_t> buf;
+    TileGrid joined;
+    for (uint32_t idx = 0; ok and idx != level.segments.size();) {
+        GeometrySegment const& seg = *level.segments[idx];
+        uint32_t const end = SegmentRunEnd(level, idx);
+        // The chunks of a run are written as one segment
+        TileGrid const* grid = &seg.grid;
+        uint32_t sectors = seg.geo.sectors;
+        if (end - idx > 1) {
+            joined = seg.grid;
+            for (uint32_t chunk = idx + 1; chunk != end; ++chunk) {
+                joined.AppendSectors(level.segments[chunk]->grid);
+                sectors += level.segments[chunk]->geo.sectors;
+            }
+            grid = &joined;
+        }
+        idx = end;
+        buf.clear();
+        EncodeSegmentData(*grid, buf);
+        // Noisy segments are smaller as a plain bitarray
+        bool const encoded = buf.size() < grid->PlaneBytes();
+        uint8_t const* data = encoded ? buf.data() : grid->PresenceBytes();
+        uint32_t const data_size = encoded ? buf.size() : grid->PlaneBytes();
+        uint32_t const encoding = encoded ? cSegmentEntries : cSegmentBitarray;
+        uint16_t const floors = seg.geo.floors, floor_planes = seg.geo.floor_planes;
+        ok = std::fwrite(&sectors, sizeof(uint32_t), 1, file) == 1
+            and std::fwrite(&floors, sizeof(uint16_t), 1, file) == 1
+            and std::fwrite(&floor_planes, sizeof(uint16_t), 1, file) == 1
+            and std::fwrite(&data_size, sizeof(uint32_t), 1, file) == 1
+            and std::fwrite(&encoding, sizeof(uint32_t), 1, file) == 1
+            and std::fwrite(data, 1, data_size, file) == data_size;
+    }
+    ok = !std::ferror(file) and ok;
+    // Buffered writes may only fail here
+    ok = std::fclose(file) == 0 and ok;
+    if (!ok) {
+        std::perror("Could not dump level");
+        // The old file is left as it was
+        std::remove(tmp_name.c_str());
+        return false;
+    }
+    if (std::rename(tmp_name.c_str(), fname) != 0) {
+        std::perror("Could not dump level");
+        std::remove(tmp_name.c_str());
         return false;
     }
+    return true;
+}
+
+// Segment headers of a level file, checked against the file size
+struct LevelFileIndex {
+    uint16_t version;
+    std::vector<SegmentGeometry> geometry;
+    std::vector<size_t> offsets; // Offset of each segment's data
+    std::vector<size_t> sizes; // Size of each segment's data
+    std::vector<uint32_t> encodings; // Encoding of each segment's data
+};
+
+// Returns false (after printing why) if the file is not a valid level
+static bool ReadLevelIndex(uint8_t const* contents, size_t size, char const* fname, LevelFileIndex& index) {
+    size_t offset = 0;
+    auto const read = [&](auto& value) {
+        if (size - offset < sizeof(value))
+            return false;
+        std::memcpy(&value, contents + offset, sizeof(value));
+        offset += sizeof(value);
+        return true;
+    };
+    auto const truncated = [&] {
+        std::fprintf(stderr, "Could not load level: '%s' is truncated\n", fname);
+        return false;
+    };
+
     uint32_t lv_hdr;
-    std::fread(&lv_hdr, sizeof(uint32_t), 1, file);
-    if (lv_hdr >> 0x10 != leveldata_version) {
+    if (!read(lv_hdr))
+        return truncated();
+    index.version = lv_hdr >> 0x10;
+    if (index.version > leveldata_version) {
+        std::fprintf(stderr, "Could not load level: data version %hu is newer than game data version (%hu)\n",
+            index.version, leveldata_version);
+        return false;
+    }
+    if (index.version != 2 and index.version != leveldata_version) {
         std::fprintf(stderr, "Warning: Level's data version (%hu) does not match game data version (%hu)\n",
-            static_cast<uint16_t>(lv_hdr >> 0x10), leveldata_version);
+            index.version, leveldata_version);
+    }
+    bool const compressed = index.version >= 3;
+    uint32_t nr_segments = lv_hdr & 0xFFFF;
+    if (compressed and !read(nr_segments))
+        return truncated();
+    // The editor never leaves a level without segments, and segment lookups rely on it
+    if (nr_segments == 0) {
+        std::fprintf(stderr, "Could not load level: '%s' has no segments\n", fname);
+        return false;
     }
+
+    // Level sectors are counted in 32 bits (see UpdateSectorOffsets)
+    uint64_t total_sectors = 0;
+    for (uint32_t idx = 0; idx != nr_segments; ++idx) {
+        SegmentGeometry geo;
+        size_t data_size;
+        uint32_t encoding = cSegmentBitarray;
+        if (compressed) {
+            uint16_t floors, floor_planes;
+            uint32_t sectors, encoded_size;
+            if (!read(sectors) or !read(floors) or !read(floor_planes) or !read(encoded_size) or !read(encoding))
+                return truncated();
+            geo = {floors, floor_planes, sectors};
+            data_size = encoded_size;
+            if (encoding != cSegmentBitarray and encoding != cSegmentEntries) {
+                std::fprintf(stderr, "Could not load level: segment %u of '%s' has unknown encoding %u\n", idx, fname, encoding);
+                return false;
+            }
+            // Every sector entry takes at least a byte
+            if (encoding == cSegmentEntries and floors != 0 and floor_planes != 0 and data_size < sectors) {
+                std::fprintf(stderr, "Could not load level: segment %u of '%s' is corrupt\n", idx, fname);
+                return false;
+            }
+            // Slots are counted in 32 bits everywhere else
+            if (uint64_t(floors) * floor_planes * sectors > UINT32_MAX) {
+                std::fprintf(stderr, "Could not load level: segment %u of '%s' is too large\n", idx, fname);
+                return false;
+            }
+        } else {
+            uint32_t seg_hdr;
+            if (!read(seg_hdr))
+                return truncated();
+            geo.floors = (seg_hdr >> 0x18) & 0xFF;
+            geo.floor_planes = (seg_hdr >> 0x10) & 0xFF;
+            geo.sectors = seg_hdr & 0xFFFF;
+        }
+        if (encoding == cSegmentBitarray) {
+            size_t const bitarray_size = (size_t(geo.floors) * geo.floor_planes * geo.sectors + 7) / 8;
+            if (compressed and data_size != bitarray_size) {
+                std::fprintf(stderr, "Could not load level: segment %u of '%s' is corrupt\n", idx, fname);
+                return false;
+            }
+            data_size = bitarray_size;
+        }
+        if (size - offset < data_size)
+            return truncated();
+        total_sectors += geo.sectors;
+        if (total_sectors > UINT32_MAX) {
+            std::fprintf(stderr, "Could not load level: '%s' is too large\n", fname);
+            return false;
+        }
+        index.geometry.push_back(geo);
+        index.offsets.push_back(offset);
+        index.sizes.push_back(data_size);
+        index.encodings.push_back(encoding);
+        offset += data_size;
+    }
+    return true;
+}
+
+// Number of segment meshes built at once, bounds the memory held before the upload
+static constexpr size_t cMeshBatchSegments = 64;
+
+// Builds the models of the segments on the thread pool and uploads them from this thread
+static void GenerateSegmentSceneModels(std::vector<GeometrySegment*> const& segments) {
+    ProfileScope scope("GenerateLevelSceneModels");
+    std::vector<SegmentMeshData> meshes(std::min(cMeshBatchSegments, segments.size()));
+    for (size_t first = 0; first < segments.size(); first += meshes.size()) {
+        size_t const count = std::min(meshes.size(), segments.size() - first);
+        ParallelFor(count, [&](size_t i) {
+            GeometrySegment const& seg = *segments[first + i];
+            BuildSegmentMesh(seg.geo, seg.grid, meshes[i]);
+        });
+        for (size_t i = 0; i != count; ++i) {
+            GeometrySegment& seg = *segments[first + i];
+            SetupSegmentBuffers(seg);
+            UploadSegmentMesh(seg, meshes[i]);
+        }
+    }
+}
+
+// Number of chunks a segment of a level file is split into, chunk k starts at sector k * cChunkSectors
+// Whole chunks of cChunkSectors, the remainder goes to the last chunk if it's too short for a chunk of its own
+static uint32_t SegmentChunkCount(uint32_t sectors) {
+    uint32_t count = sectors / cChunkSectors;
+    if (count == 0 or sectors % cChunkSectors >= cMinChunkSectors)
+        ++count;
+    return count;
+}
+
+static void AddSegmentChunks(LevelInfo& level, SegmentGeometry const& geo, TileGrid& grid) {
+    uint32_t const count = SegmentChunkCount(geo.sectors);
+    // Split from the end, so each split only copies the split off chunk
+    std::vector<TileGrid> chunks(count);
+    for (uint32_t chunk = count - 1; chunk != 0; --chunk)
+        grid.SplitSectors(chunk * cChunkSectors, chunks[chunk]);
+    chunks[0] = std::move(grid);
+    for (uint32_t chunk = 0; chunk != count; ++chunk) {
+        auto& seg = *level.segments.emplace_back(new GeometrySegment);
+        seg.geo = geo;
+        seg.geo.sectors = chunks[chunk].Sectors();
+        seg.grid = std::move(chunks[chunk]);
+        seg.joined = chunk != 0;
+        GetFloorProperties(seg);
+    }
+}
+
+bool ReadLevelFromFile(LevelInfo& level, char const* fname) {
+    auto mapping = MapFile(fname);
+    if (!mapping) {
+        std::perror("Could not load level");
+        return false;
+    }
+    // Validate the whole file before replacing the current level
+    LevelFileIndex index;
+    if (!ReadLevelIndex(mapping->data, mapping->size, fname, index))
+        return false;
+    size_t const nr_segments = index.geometry.size();
+    std::vector<TileGrid> grids(nr_segments);
+    for (size_t idx = 0; idx != nr_segments; ++idx) {
+        SegmentGeometry const& geo = index.geometry[idx];
+        uint8_t const* data = mapping->data + index.offsets[idx];
+        if (index.encodings[idx] == cSegmentBitarray) {
+            // The segments reference the mapped slot bits, nothing is copied until they are edited
+            grids[idx].Borrow(geo.floors * geo.floor_planes, geo.sectors, data);
+        } else if (!DecodeSegmentData(data, index.sizes[idx], geo, grids[idx])) {
+            std::fprintf(stderr, "Could not load level: segment %zu of '%s' is corrupt\n", idx, fname);
+            return false;
+        }
+    }
+
     CleanupLevel(level);
-    size_t nr_segments = lv_hdr & 0xFFFF;
     level.segments.reserve(nr_segments);
-    while (nr_segments --) {
-        uint32_t seg_hdr;
-        std::fread(&seg_hdr, sizeof(uint32_t), 1, file);
-        auto& seg = *level.segments.emplace_back(new GeometrySegment);
-        seg.geo.floors = (seg_hdr >> 0x18) & 0xFF;
-        seg.geo.floor_planes = (seg_hdr >> 0x10) & 0xFF;
-        seg.geo.sectors = seg_hdr & 0xFFFF;
-        size_t const num_slots = seg.geo.floors * seg.geo.floor_planes * seg.geo.sectors;
-        size_t const buf_size = (num_slots + 7) / 8;
-        uint8_t* buf = reinterpret_cast<uint8_t*>(alloca(buf_size));
-        std::fread(buf, 1, buf_size, file);
-        seg.data.resize(num_slots);
-        for (size_t s = 0; s < num_slots; ++s)
-            seg.data[s] = (buf[s / 8] >> (s & 7)) & 1;
+    for (size_t idx = 0; idx != nr_segments; ++idx)
+        AddSegmentChunks(level, index.geometry[idx], grids[idx]);
+    // Only needed if a segment borrows from it
+    if (std::find(index.encodings.begin(), index.encodings.end(), cSegmentBitarray) != index.encodings.end())
+        level.mapping = std::move(mapping);
+    UpdateSectorOffsets(level);
+    return true;
+}
+
+bool LoadLevelFromFile(LevelInfo& level, char const* fname) {
+    if (!ReadLevelFromFile(level, fname))
+        return false;
+    std::vector<GeometrySegment*> segments;
+    for (auto& seg : level.segments)
+        segments.push_back(seg.get());
+    GenerateSegmentSceneModels(segments);
+    return true;
+}
+
+void TakeLevelSnapshot(LevelInfo& level, LevelSnapshot& snapshot) {
+    snapshot.layout_changed = level.layout_changed;
+    snapshot.serials.clear();
+    snapshot.stream_file.reset();
+    snapshot.changes.clear();
+    if (level.layout_changed) {
+        for (auto const& seg : level.segments)
+            snapshot.serials.push_back(seg->serial);
+        if (level.stream)
+            snapshot.stream_file = level.stream->file;
+        level.layout_changed = false;
+    }
+    for (uint32_t idx = 0; idx != level.segments.size(); ++idx) {
+        GeometrySegment& seg = *level.segments[idx];
+        // Streamed segments are loaded by the render thread's own stream
+        if (level.stream)
+            seg.published = true;
+        if (seg.published and seg.dirty_begin == seg.dirty_end)
+            continue;
+        if (!seg.published)
+            MarkSegmentChanged(seg);
+        // Borrowed presence bits aren't copied, the snapshot keeps the mapping alive instead
+        snapshot.changes.push_back({idx, seg.geo, seg.grid, seg.dirty_begin, seg.dirty_end});
+        seg.published = true;
+        seg.dirty_begin = seg.dirty_end = 0;
+    }
+    snapshot.mapping = level.mapping;
+}
+
+// Replaces the segments of the scene, keeping the ones that are still in the level (and their GPU data)
+static void ApplyLevelLayout(LevelInfo& scene, LevelSnapshot const& snapshot) {
+    if (snapshot.stream_file) {
+        // Same index as the main thread's level, the file isn't read again
+        AttachLevelStream(scene, snapshot.stream_file);
+        if (scene.segments.size() != snapshot.serials.size()) {
+            // Keep the indices valid, nothing is drawn (and nothing is streamed, the scene has no stream)
+            std::fprintf(stderr, "Could not stream level: segments don't match the snapshot\n");
+            CleanupLevel(scene);
+            for (size_t idx = 0; idx != snapshot.serials.size(); ++idx) {
+                auto& seg = *scene.segments.emplace_back(new GeometrySegment);
+                seg.geo = {0, 0, 0};
+                seg.resident = false;
+            }
+        }
+        for (size_t idx = 0; idx != snapshot.serials.size(); ++idx)
+            scene.segments[idx]->serial = snapshot.serials[idx];
+        return;
+    }
+    scene.stream.reset();
+    std::unordered_map<uint64_t, std::unique_ptr<GeometrySegment>> kept;
+    for (auto& seg : scene.segments)
+        kept.emplace(seg->serial, std::move(seg));
+    scene.segments.clear();
+    for (uint64_t const serial : snapshot.serials) {
+        auto it = kept.find(serial);
+        if (it != kept.end()) {
+            scene.segments.push_back(std::move(it->second));
+        } else {
+            auto& seg = *scene.segments.emplace_back(new GeometrySegment);
+            seg.serial = serial;
+        }
+    }
+    // The segments left in kept are released here
+}
+
+void ApplyLevelSnapshot(LevelInfo& scene, LevelSnapshot& snapshot) {
+    if (!snapshot.layout_changed and snapshot.changes.empty())
+        return;
+    ProfileScope scope("ApplyLevelSnapshot");
+    if (snapshot.layout_changed)
+        ApplyLevelLayout(scene, snapshot);
+
+    std::vector<GeometrySegment*> created;
+    for (auto& change : snapshot.changes) {
+        GeometrySegment& seg = *scene.segments[change.segment];
+        bool const reshaped = seg.geo.floors != change.geo.floors or seg.geo.floor_planes != change.geo.floor_planes;
+        seg.geo = change.geo;
+        seg.grid = std::move(change.grid);
         GetFloorProperties(seg);
-        SetupSegmentBuffers(seg);
-        GenerateLevelSceneModel(seg);
+        if (!seg.gpu_ready) {
+            created.push_back(&seg);
+        } else if (reshaped) {
+            GenerateLevelSceneModel(seg);
+        } else {
+            // A changed sector count is noticed by UpdateLevelSceneModel
+            seg.dirty_begin = std::min(change.dirty_begin, seg.geo.sectors);
+            seg.dirty_end = std::min(change.dirty_end, seg.geo.sectors);
+            UpdateLevelSceneModel(seg);
+        }
+    }
+    GenerateSegmentSceneModels(created);
+    // After the segments that borrowed from the previous mapping are gone
+    if (!scene.stream)
+        scene.mapping = snapshot.mapping;
+    UpdateSectorOffsets(scene);
+}
+
+// Segments closer than this to the visible sectors are kept resident
+static constexpr uint32_t cStreamMarginSectors = 512;
+
+LevelStreamFile::~LevelStreamFile() {
+    std::fclose(handle);
+}
+
+LevelStream::~LevelStream() {
+    {
+        std::lock_guard guard(lock);
+        stop = true;
+    }
+    wakeup.notify_one();
+    if (worker.joinable())
+        worker.join();
+}
+
+static void StreamWorker(LevelStream& stream) {
+    // Last entry-encoded segment, the chunks of a long segment are usually requested together
+    // Unlike a bitarray, entries can only be decoded from the start of the segment
+    TileGrid decoded;
+    uint32_t decoded_source = UINT32_MAX;
+    bool decoded_ok = false;
+
+    std::unique_lock guard(stream.lock);
+    while (true) {
+        stream.wakeup.wait(guard, [&] { return stream.stop or !stream.requests.empty(); });
+        if (stream.stop)
+            return;
+        LevelStream::Request req = std::move(stream.requests.front());
+        stream.requests.pop_front();
+        guard.unlock();
+
+        // The file is only touched by the worker after the stream is opened
+        uint32_t const ring = req.geo.floors * req.geo.floor_planes;
+        // Chunks start at a multiple of 8 sectors, so on a byte of the plane
+        size_t const chunk_offset = size_t(ring) * req.first_sector / 8;
+        bool ok;
+        if (req.encoding == cSegmentBitarray) {
+            // Only the chunk's bits are read
+            std::vector<uint8_t> data((size_t(ring) * req.geo.sectors + 7) / 8);
+            std::fseek(stream.file->handle, static_cast<long>(req.offset + chunk_offset), SEEK_SET);
+            ok = std::fread(data.data(), 1, data.size(), stream.file->handle) == data.size();
+            if (ok)
+                req.grid.Assign(ring, req.geo.sectors, data.data());
+        } else {
+            if (req.source != decoded_source) {
+                std::vector<uint8_t> data(req.size);
+                std::fseek(stream.file->handle, static_cast<long>(req.offset), SEEK_SET);
+                decoded_ok = std::fread(data.data(), 1, data.size(), stream.file->handle) == data.size()
+                    and DecodeSegmentData(data.data(), data.size(), req.source_geo, decoded);
+                decoded_source = req.source;
+            }
+            ok = decoded_ok;
+            if (ok)
+                req.grid.Assign(ring, req.geo.sectors, decoded.PresenceBytes() + chunk_offset);
+        }
+        if (!ok) {
+            // Keep going with an empty segment, the rest of the level may still be fine
+            std::fprintf(stderr, "Could not stream level segment %u\n", req.segment);
+            req.grid.Reset(ring, req.geo.sectors, false);
+        }
+        BuildSegmentMesh(req.geo, req.grid, req.mesh);
+
+        guard.lock();
+        stream.done.push_back(std::move(req));
+    }
+}
+
+static void AttachLevelStream(LevelInfo& level, std::shared_ptr<LevelStreamFile const> file) {
+    CleanupLevel(level);
+    auto stream = std::make_unique<LevelStream>();
+    // Split the same way as in AddSegmentChunks, the worker loads each chunk on its own
+    for (uint32_t source = 0; source != file->geometry.size(); ++source) {
+        SegmentGeometry const& geo = file->geometry[source];
+        uint32_t const count = SegmentChunkCount(geo.sectors);
+        for (uint32_t chunk = 0; chunk != count; ++chunk) {
+            auto& seg = *level.segments.emplace_back(new GeometrySegment);
+            seg.geo = geo;
+            seg.geo.sectors = chunk + 1 == count ? geo.sectors - chunk * cChunkSectors : cChunkSectors;
+            seg.joined = chunk != 0;
+            seg.resident = false;
+            GetFloorProperties(seg);
+            stream->sources.push_back(source);
+            stream->first_sectors.push_back(chunk * cChunkSectors);
+        }
     }
-    std::fclose(file);
+    stream->file = std::move(file);
+    stream->pending.resize(level.segments.size());
+    level.stream = std::move(stream);
+    UpdateSectorOffsets(level);
+}
+
+bool OpenLevelStream(LevelInfo& level, char const* fname) {
+    // The headers are read through a temporary mapping, the worker reads the segments from the file
+    LevelFileIndex index;
+    {
+        auto mapping = MapFile(fname);
+        if (!mapping) {
+            std::perror("Could not load level");
+            return false;
+        }
+        if (!ReadLevelIndex(mapping->data, mapping->size, fname, index))
+            return false;
+    }
+    std::FILE* file = std::fopen(fname, "rb");
+    if (!file) {
+        std::perror("Could not load level");
+        return false;
+    }
+    auto stream_file = std::make_shared<LevelStreamFile>();
+    stream_file->handle = file;
+    stream_file->geometry = std::move(index.geometry);
+    stream_file->offsets = std::move(index.offsets);
+    stream_file->sizes = std::move(index.sizes);
+    stream_file->encodings = std::move(index.encodings);
+    AttachLevelStream(level, std::move(stream_file));
     return true;
 }
+
+void StreamLevel(LevelInfo& level, uint32_t first_sector, uint32_t end_sector) {
+    if (!level.stream or level.segments.empty())
+        return;
+    ProfileScope scope("StreamLevel");
+    LevelStream& stream = *level.stream;
+    if (!stream.worker.joinable())
+        stream.worker = std::thread(StreamWorker, std::ref(stream));
+    uint32_t const total = level.sector_offsets.back();
+    uint32_t const first = FindSegment(level, first_sector > cStreamMarginSectors ? first_sector - cStreamMarginSectors : 0);
+    uint32_t const last = FindSegment(level, std::min(end_sector + cStreamMarginSectors, total));
+
+    std::deque<LevelStream::Request> done;
+    {
+        std::lock_guard guard(stream.lock);
+        done.swap(stream.done);
+        // Drop requests that went out of range before the worker got to them
+        std::erase_if(stream.requests, [&](LevelStream::Request const& req) {
+            bool const stale = req.segment < first or req.segment > last;
+            if (stale)
+                stream.pending[req.segment] = false;
+            return stale;
+        });
+    }
+
+    // Upload the finished segments (GL calls stay on this thread)
+    for (auto& req : done) {
+        stream.pending[req.segment] = false;
+        if (req.segment < first or req.segment > last)
+            continue;
+        GeometrySegment& seg = *level.segments[req.segment];
+        seg.grid = std::move(req.grid);
+        seg.resident = true;
+        SetupSegmentBuffers(seg);
+        UploadSegmentMesh(seg, req.mesh);
+        stream.resident.push_back(req.segment);
+    }
+
+    // Evict segments that went out of range
+    std::erase_if(stream.resident, [&](uint32_t idx) {
+        if (idx >= first and idx <= last)
+            return false;
+        GeometrySegment& seg = *level.segments[idx];
+        ReleaseSegmentBuffers(seg);
+        seg.grid.Clear();
+        seg.resident = false;
+        return true;
+    });
+
+    // Request the missing ones
+    bool requested = false;
+    {
+        std::lock_guard guard(stream.lock);
+        for (uint32_t idx = first; idx <= last; ++idx) {
+            GeometrySegment const& seg = *level.segments[idx];
+            if (seg.resident or stream.pending[idx])
+                continue;
+            stream.pending[idx] = true;
+            uint32_t const source = stream.sources[idx];
+            LevelStreamFile const& file = *stream.file;
+            stream.requests.push_back({
+                .segment = idx,
+                .source = source,
+                .offset = file.offsets[source],
+                .size = file.sizes[source],
+                .encoding = file.encodings[source],
+                .source_geo = file.geometry[source],
+                .first_sector = stream.first_sectors[idx],
+                .geo = seg.geo,
+                .grid = {},
+                .mesh = {},
+            });
+            requested = true;
+        }
+    }
+    if (requested)
+        stream.wakeup.notify_one();
+}
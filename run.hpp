@@ -1,13 +1,24 @@
 #pragma once
 
 #include <cstdint>
+#include <cmath>
+#include <cstdio>
 #include <array>
 #include <memory>
+#include <string>
 #include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include "event.hpp"
+#include "util.hpp"
+#include "tile_grid.hpp"
 
-constexpr uint16_t leveldata_version = 2;
+constexpr uint16_t leveldata_version = 3;
+
+inline double const C_PI = std::acos(-1);
 
 struct SegmentGeometry {
     uint32_t floors; // Number of standable floors; may be 0 for empty space (gap segment)
@@ -18,9 +29,42 @@ struct SegmentGeometry {
     friend constexpr bool operator!=(SegmentGeometry const& a, SegmentGeometry const& b) = default;
 };
 
+// XY positions of the floors and slots of a segment geometry (the same for any number of sectors)
+struct FloorProfile {
+    struct Floor {
+        float xl, yl, xr, yr; // XY pos of left/right corners
+    };
+    std::vector<Floor> floors;
+    // Left corner of each slot of a sector ring, interpolated along its floor
+    std::vector<std::array<float, 2>> slots;
+    // Same as slots, normalized to 16-bit integers (packed vertex format)
+    std::vector<std::array<int16_t, 2>> slots_snorm;
+    // Main floor properties, see GeometrySegment
+    float yval;
+    float pwidth;
+    float xmin;
+    float xmax;
+};
+
+// Profile of the geometry's floors and floor_planes, computed on first use and kept for the whole run
+// Safe to call from any thread
+FloorProfile const& GetFloorProfile(SegmentGeometry const& geo);
+
+// Unique for the whole run, see GeometrySegment::serial
+uint64_t NewSegmentSerial();
+
+// Long segments are kept as runs of chunks (joined segments, see GeometrySegment::joined) of cMinChunkSectors
+// to cMaxChunkSectors sectors, so an edit only copies, shifts and rebuilds the sectors of its chunk
+// The chunks of a run are a single segment in the level file and in the editor's segment mode
+inline constexpr uint32_t cChunkSectors = 4096; // Multiple of 8, the chunks of a mapped segment can borrow its bits
+inline constexpr uint32_t cMinChunkSectors = cChunkSectors / 2;
+inline constexpr uint32_t cMaxChunkSectors = cChunkSectors * 2;
+
 // Each segment can have different floor/plane configuration
 struct GeometrySegment {
     SegmentGeometry geo;
+    // Identifies the segment in the main thread's level and in its mirror on the render thread
+    uint64_t serial = NewSegmentSerial();
 
     // Floor data
     float yval;
@@ -29,12 +73,32 @@ struct GeometrySegment {
     float xmax;
 
     // Segment data
-    // 1 means floor plane present
-    // 0 means empty space
-    std::vector<uint8_t> data;
-    uint32_t gl_vao = 0;
+    // Presence bit set means floor plane present, otherwise empty space
+    TileGrid grid;
+    // Continues the previous segment (a chunk of the same segment, with the same floors and floor_planes)
+    bool joined = false;
+    // False if the data and GPU buffers are not loaded (streamed levels only)
+    bool resident = true;
+    // Sent to the render thread at least once (main thread level only, see TakeLevelSnapshot)
+    bool published = false;
+    // GPU data, owned by the level renderer (see render.hpp); only set up on the render thread
+    bool gpu_ready = false;
     uint32_t gl_vbo = 0;
-    size_t vtx_count;
+    uint32_t gl_tex = 0;
+    // Position of the segment in level-wide buffers
+    // (mesh: first vertex and first index word, instanced: first instance and entry in the segment offset table)
+    size_t gpu_base = 0;
+    size_t gpu_index_base = 0;
+    uint32_t gpu_slot = 0;
+    size_t vtx_count = 0;
+    size_t idx_count = 0;
+    uint32_t idx_type = 0; // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT, depending on the vertex count
+    // Number of sectors the uploaded mesh was laid out for
+    uint32_t mesh_sectors = 0;
+    // Range of sectors [dirty_begin, dirty_end) whose uploaded mesh is out of date
+    // (in the main thread's level: changed since the last snapshot)
+    uint32_t dirty_begin = 0;
+    uint32_t dirty_end = 0;
 
     GeometrySegment() = default;
     ~GeometrySegment();
@@ -43,23 +107,118 @@ struct GeometrySegment {
     GeometrySegment(GeometrySegment const&) = delete;
 };
 
+// Level model data of a segment, built on the CPU before the upload (see BuildSegmentMesh)
+struct SegmentMeshData {
+    std::vector<uint8_t> vertices; // Renderer specific, may be empty
+    std::vector<uint8_t> indices;
+};
+
+// Open level file of a streamed level and its validated index, shared by the main thread's level and its mirror
+struct LevelStreamFile {
+    std::FILE* handle; // Only read by the render thread's worker
+    // Segments of the file
+    std::vector<SegmentGeometry> geometry;
+    std::vector<size_t> offsets; // File offset of each segment's data
+    std::vector<size_t> sizes; // Size of each segment's data
+    std::vector<uint32_t> encodings; // Encoding of each segment's data (see run.cpp)
+
+    ~LevelStreamFile();
+};
+
+// Loads segment data of a streamed level on a worker thread
+struct LevelStream {
+    struct Request {
+        uint32_t segment;
+        uint32_t source; // Segment of the file the chunk is from
+        size_t offset; // File offset of the source segment's data
+        size_t size; // Size of the source segment's data
+        uint32_t encoding;
+        SegmentGeometry source_geo;
+        uint32_t first_sector; // First sector of the chunk in the source segment
+        SegmentGeometry geo;
+        // Filled by the worker
+        TileGrid grid;
+        SegmentMeshData mesh;
+    };
+
+    std::shared_ptr<LevelStreamFile const> file;
+    // Long segments of the file are split into chunks like in loaded levels (see cChunkSectors)
+    std::vector<uint32_t> sources; // File segment of each level segment
+    std::vector<uint32_t> first_sectors; // First sector of each level segment in its file segment
+    std::vector<uint32_t> resident; // Indices of the resident segments
+    std::vector<bool> pending; // Segments with a request in flight
+
+    // Started by the first StreamLevel call, so only the render thread's mirror has one
+    std::thread worker;
+    std::mutex lock;
+    std::condition_variable wakeup;
+    // Both guarded by lock
+    std::deque<Request> requests;
+    std::deque<Request> done;
+    bool stop = false;
+
+    ~LevelStream();
+};
+
 struct LevelInfo {
     std::vector<std::unique_ptr<GeometrySegment>> segments;
+    // First sector of each segment from the start of the level, followed by the total sector count
+    std::vector<uint32_t> sector_offsets;
+    // Set if the level is streamed; non-resident segments only have their geometry
+    std::unique_ptr<LevelStream> stream;
+    // Set if the level is mapped from a file; segment grids (and their copies) may borrow its presence bits
+    std::shared_ptr<MappedFile> mapping;
+    // Set by UpdateSectorOffsets, cleared by TakeLevelSnapshot
+    bool layout_changed = true;
+};
+
+// Changes of a level since the previous snapshot, used to mirror the main thread's level on the render thread
+struct LevelSnapshot {
+    struct Change {
+        uint32_t segment; // Index in the level
+        SegmentGeometry geo;
+        TileGrid grid;
+        // Changed sectors, the whole segment if it wasn't published yet
+        uint32_t dirty_begin, dirty_end;
+    };
+    // Set if segments were added, removed or resized; serials has the serial of each segment in order
+    bool layout_changed = false;
+    std::vector<uint64_t> serials;
+    // Level file if the level is streamed, the render thread streams it on its own
+    std::shared_ptr<LevelStreamFile const> stream_file;
+    std::vector<Change> changes;
+    // Keeps the mapped file alive while the copied grids borrow from it
+    std::shared_ptr<MappedFile> mapping;
 };
 
+// Main thread: fills the snapshot with the level's changes since the last call
+void TakeLevelSnapshot(LevelInfo& level, LevelSnapshot& snapshot);
+// Render thread: applies the changes to the mirror of the level and updates its models
+void ApplyLevelSnapshot(LevelInfo& scene, LevelSnapshot& snapshot);
+
 LevelInfo LoadBlankLevel(); // Default level on editor startup
-LevelInfo LoadLevelFromArray(size_t num_sectors, uint8_t* data);
+// Single segment level (a run of chunks if it's long) with the blank level's geometry, data has one byte per slot (bit 0 is presence)
+LevelInfo LoadLevelFromArray(size_t num_sectors, uint8_t const* data);
 void CleanupLevel(LevelInfo& level);
+// Recomputes sector_offsets, must be called after segments are added, removed or resized
+void UpdateSectorOffsets(LevelInfo& level);
+// Index of the segment containing the level sector (binary search in sector_offsets)
+uint32_t FindSegment(LevelInfo const& level, uint32_t sector);
+// First chunk of the run of joined segments containing the segment, and the segment after its last chunk
+uint32_t SegmentRunBegin(LevelInfo const& level, uint32_t segment);
+uint32_t SegmentRunEnd(LevelInfo const& level, uint32_t segment);
+// Splits the chunk in two if it grew past cMaxChunkSectors, or merges it with a chunk of its run if it shrank
+// below cMinChunkSectors; segment and sector are updated to the same sector of the level
+// The changed chunks are marked, UpdateSectorOffsets must be called after
+void RebalanceChunk(LevelInfo& level, uint32_t& segment, uint32_t& sector);
 
-/// Layout is array of Vtx
-/// Sector-0 is at Z=0
-/// Sector-n is at Z=-n (increment is Z += -1 for each next sector)
-/// All XY coords are inside the unit circle (radius 1)
-/// Order of floors/planes counter-clockwise
-void GenerateLevelSceneModel(GeometrySegment& seg);
+// Marks the sector's part of the level model as out of date (see UpdateLevelSceneModel)
+void MarkSegmentDirty(GeometrySegment& seg, uint32_t sector);
+// Marks the whole segment as out of date, e.g. after its sectors were inserted or erased
+void MarkSegmentChanged(GeometrySegment& seg);
 void GenerateCharacterModel(uint32_t vbo);
-void SetupSegmentBuffers(GeometrySegment& seg);
-void SetupLevelMeshArray(uint32_t vbo);
+// Uploads the tile color palette (sColorMap) to a vec3[4] uniform (program must be bound)
+void UploadLevelPalette(int32_t loc_uPalette);
 
 enum class MeshVisualMode : uint8_t {
     None,
@@ -69,6 +228,9 @@ enum class MeshVisualMode : uint8_t {
 };
 
 void GenerateSegmentSelectionModel(SegmentGeometry const& geo);
+// Tiles of a single sector, twice: colored as the cursor on an empty tile (slot k at vertex 6 * k)
+// and on a present tile (at vertex 6 * (ring + k))
+void GenerateSectorCursorModel(SegmentGeometry const& geo);
 void GenerateSegmentOutlineModel(SegmentGeometry const& geo);
 void GenerateSegmentSectorWireModel(SegmentGeometry const& geo);
 void GenerateSegmentSlotWireModel(SegmentGeometry const& geo);
@@ -79,9 +241,18 @@ void GetFloorProperties(GeometrySegment& seg);
 //void RenderLevel(LevelInfo const& level);
 //void RenderLevelWithSegment(LevelInfo const& level, uint32_t segment, uint32_t gl_vao);
 
-void DumpLevelToFile(LevelInfo const& level, char const* fname);
+// Returns true on success, the old file is kept otherwise
+bool DumpLevelToFile(LevelInfo const& level, char const* fname);
 // Returns true on success
 bool LoadLevelFromFile(LevelInfo& level, char const* fname);
+// Same as LoadLevelFromFile, without generating the level models (no GL calls, any thread)
+bool ReadLevelFromFile(LevelInfo& level, char const* fname);
+// Reads only the segment headers, segment data is loaded later by StreamLevel
+// Returns true on success
+bool OpenLevelStream(LevelInfo& level, char const* fname);
+// Makes the segments around level sectors [first_sector, end_sector) resident and evicts the others
+// Loading happens in the background, finished segments are uploaded on the next call
+void StreamLevel(LevelInfo& level, uint32_t first_sector, uint32_t end_sector);
 
 
 using Pos = std::array<float, 3>;
@@ -92,9 +263,60 @@ struct Vtx {
     Col col;
 };
 
+// Tile colors, indexed by presence, the editor cursor uses presence | 2
+extern Col const sColorMap[4];
+
+// Z scaling of the level model (length of a sector)
+inline constexpr float sLevelZScale = 0.04f;
+
+// Length of a simulation step in seconds, the simulation runs at this rate regardless of the frame rate
+inline constexpr double cSimStep = 1.0 / 120;
+// Initial player speed, 0.002 per frame at 60 Hz
+inline constexpr float cPlayerSpeed = 0.12f;
+
+// Player position along the level, advanced by StepPlayer
+struct PlayerSim {
+    float prevZ, curZ; // Before and after the last step
+    float speed; // Z units per second
+};
+
+void StepPlayer(PlayerSim& sim);
+// Z at alpha (in [0, 1]) of the way from the previous step to the last one
+inline float InterpolatePlayerZ(PlayerSim const& sim, float alpha) {
+    return sim.prevZ + alpha * (sim.curZ - sim.prevZ);
+}
+// Tile collision queries for the player simulation
+
+// A level sector and the segment containing it
+struct SectorLocation {
+    uint32_t level_sector; // From the start of the level
+    uint32_t segment;
+    uint32_t sector; // From the start of the segment
+};
+
+// Finds the level sector at Z (floor(Z / sLevelZScale)), returns false if Z is outside the level
+// O(1) if the sector is still in the hint segment (e.g. the last location's), otherwise a binary search in sector_offsets
+bool LocateSector(LevelInfo const& level, float z, SectorLocation& loc, uint32_t hint = 0);
+// Whether the tile at floor/plane of the sector is present, reads a single bit
+// Floors are counted from the bottom when the segment is rotated by `rotation` floors (floor `rotation` at the bottom)
+// False in gap segments and past the last plane of the floor; the segment must be resident
+bool IsTilePresent(LevelInfo const& level, SectorLocation const& loc, uint32_t floor, uint32_t plane, uint32_t rotation = 0);
+// Whether a tile of the bottom floor is under the player at the location
+// The player is one plane wide and centered, so it stands on either of the middle planes of an even floor
+bool IsPlayerSupported(LevelInfo const& level, SectorLocation const& loc, uint32_t rotation = 0);
+
+// What the render thread draws a frame from (defined in main.cpp)
+struct FrameSnapshot;
+
+// Called on the main thread, the state is drawn on the render thread from its snapshots
 struct GameStateDef {
     void (*init)(void* common_ctx, void* state_ctx);
     void (*handle_event)(WinEvent const& ev, void* ctx);
-    void (*render)(void* ctx);
+    // Finishes the work the events left pending, once per published frame (before the level snapshot is taken)
+    void (*commit)(void* ctx);
+    // Advances the simulation by cSimStep
+    void (*update)(void* ctx);
+    // Copies the state's view into the frame
+    void (*snapshot)(void* ctx, FrameSnapshot& frame);
     void (*change)(void* ctx); // Action that happens when a different state is selected
 };
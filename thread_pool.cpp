@@ -0,0 +1,100 @@
+#include "thread_pool.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct ThreadPool {
+    std::vector<std::thread> threads;
+    std::mutex run_lock; // Held for the whole ParallelFor call
+    std::mutex lock;
+    std::condition_variable wakeup, finished;
+    // Current job, guarded by lock
+    std::function<void(size_t)> const* job = nullptr;
+    size_t count = 0;
+    uint64_t generation = 0;
+    size_t busy = 0; // Workers still running the current job
+    bool stop = false;
+    // Next index of the current job to run
+    std::atomic<size_t> next = 0;
+
+    ThreadPool() {
+        // The calling thread runs a share of the job too
+        unsigned const cores = std::thread::hardware_concurrency();
+        for (unsigned i = 1; i < cores; ++i)
+            threads.emplace_back(&ThreadPool::Worker, this);
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard guard(lock);
+            stop = true;
+        }
+        wakeup.notify_all();
+        for (auto& thread : threads)
+            thread.join();
+    }
+
+    void RunJob(std::function<void(size_t)> const& fn, size_t n) {
+        for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < n;)
+            fn(i);
+    }
+
+    void Worker() {
+        uint64_t seen = 0;
+        std::unique_lock guard(lock);
+        for (;;) {
+            wakeup.wait(guard, [&] { return stop or generation != seen; });
+            if (stop)
+                return;
+            seen = generation;
+            auto const& fn = *job;
+            size_t const n = count;
+            guard.unlock();
+            RunJob(fn, n);
+            guard.lock();
+            if (--busy == 0)
+                finished.notify_one();
+        }
+    }
+
+    void Run(size_t n, std::function<void(size_t)> const& fn) {
+        std::lock_guard serialize(run_lock);
+        {
+            std::lock_guard guard(lock);
+            job = &fn;
+            count = n;
+            next = 0;
+            busy = threads.size();
+            ++generation;
+        }
+        wakeup.notify_all();
+        RunJob(fn, n);
+        // Every worker checks in, even if the calling thread already ran all the indices
+        std::unique_lock guard(lock);
+        finished.wait(guard, [&] { return busy == 0; });
+        job = nullptr;
+    }
+};
+
+static ThreadPool& GetThreadPool() {
+    static ThreadPool pool;
+    return pool;
+}
+
+size_t WorkerCount() {
+    return GetThreadPool().threads.size() + 1;
+}
+
+void ParallelFor(size_t count, std::function<void(size_t)> const& fn) {
+    ThreadPool& pool = GetThreadPool();
+    if (count <= 1 or pool.threads.empty()) {
+        for (size_t i = 0; i != count; ++i)
+            fn(i);
+        return;
+    }
+    pool.Run(count, fn);
+}
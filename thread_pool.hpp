@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+// Number of threads ParallelFor runs on, including the calling thread
+size_t WorkerCount();
+// Calls fn(i) for each i in [0, count) on the worker threads and the calling thread, returns once all calls are done
+// Calls from several threads are run one after another; fn must not call ParallelFor itself
+void ParallelFor(size_t count, std::function<void(size_t)> const& fn);
@@ -0,0 +1,183 @@
+#include "tile_grid.hpp"
+#include "bitops.hpp"
+
+#include <algorithm>
+
+using Word = TileGrid::Word;
+static constexpr size_t cWordBits = TileGrid::cWordBits;
+
+static size_t WordCount(size_t bits) {
+    return (bits + cWordBits - 1) / cWordBits;
+}
+
+// Mask of count bits starting at bit shift of a word
+static Word BitMask(size_t shift, size_t count) {
+    return (count == cWordBits ? ~Word(0) : (Word(1) << count) - 1) << shift;
+}
+
+static void ClearTail(std::vector<Word>& plane, size_t bits) {
+    if (bits % cWordBits)
+        plane.back() &= BitMask(0, bits % cWordBits);
+}
+
+static void ClearRange(std::vector<Word>& plane, size_t begin, size_t end) {
+    while (begin != end) {
+        size_t const count = std::min(cWordBits - begin % cWordBits, end - begin);
+        plane[begin / cWordBits] &= ~BitMask(begin % cWordBits, count);
+        begin += count;
+    }
+}
+
+// Returns the 64 bits starting at bit, 0s past the end of the plane
+static Word ReadWord(Word const* plane, size_t words, size_t bit) {
+    size_t const word = bit / cWordBits, shift = bit % cWordBits;
+    Word value = word < words ? plane[word] >> shift : 0;
+    if (shift and word + 1 < words)
+        value |= plane[word + 1] << (cWordBits - shift);
+    return value;
+}
+
+// ORs count bits of src into dst, a word at a time
+static void CopyBits(Word* dst, size_t dst_words, size_t dst_bit, Word const* src, size_t src_words, size_t src_bit, size_t count) {
+    while (count) {
+        size_t const n = std::min(count, cWordBits);
+        Word const value = ReadWord(src, src_words, src_bit) & BitMask(0, n);
+        size_t const word = dst_bit / cWordBits, shift = dst_bit % cWordBits;
+        dst[word] |= value << shift;
+        if (shift and word + 1 < dst_words)
+            dst[word + 1] |= value >> (cWordBits - shift);
+        dst_bit += n;
+        src_bit += n;
+        count -= n;
+    }
+}
+
+static void CopyBits(std::vector<Word>& dst, size_t dst_bit, std::vector<Word> const& src, size_t src_bit, size_t count) {
+    CopyBits(dst.data(), dst.size(), dst_bit, src.data(), src.size(), src_bit, count);
+}
+
+void TileGrid::Reset(uint32_t ring, uint32_t sectors, bool present) {
+    this->ring = ring;
+    this->sectors = sectors;
+    borrowed = nullptr;
+    presence.assign(WordCount(Size()), present ? ~Word(0) : 0);
+    ClearTail(presence, Size());
+}
+
+void TileGrid::Borrow(uint32_t ring, uint32_t sectors, uint8_t const* bits) {
+    this->ring = ring;
+    this->sectors = sectors;
+    borrowed = bits;
+    presence.clear();
+}
+
+void TileGrid::Assign(uint32_t ring, uint32_t sectors, uint8_t const* bits) {
+    Borrow(ring, sectors, bits);
+    Own();
+}
+
+void TileGrid::AssignBytes(uint32_t ring, uint32_t sectors, uint8_t const* values) {
+    Reset(ring, sectors, false);
+    // The words are little endian, so the plane can be written as a bitarray
+    PackBits(values, Size(), reinterpret_cast<uint8_t*>(presence.data()));
+}
+
+void TileGrid::Clear() {
+    ring = sectors = 0;
+    borrowed = nullptr;
+    presence = {};
+}
+
+void TileGrid::Own() {
+    if (!borrowed)
+        return;
+    presence.assign(WordCount(Size()), 0);
+    std::memcpy(presence.data(), borrowed, PlaneBytes());
+    // The file's padding bits aren't guaranteed to be 0
+    ClearTail(presence, Size());
+    borrowed = nullptr;
+}
+
+void TileGrid::TogglePresent(size_t slot) {
+    Own();
+    presence[slot / cWordBits] ^= Word(1) << (slot % cWordBits);
+}
+
+void TileGrid::ReadSector(uint32_t sector, Word* out) const {
+    size_t const words = WordCount(ring);
+    std::fill_n(out, words, 0);
+    if (borrowed) {
+        // Same as CopyBits, but the borrowed bits aren't padded to whole words
+        size_t const begin = size_t(sector) * ring, plane_words = WordCount(Size());
+        for (size_t w = 0; w != words; ++w) {
+            size_t const bit = begin + w * cWordBits, word = bit / cWordBits, shift = bit % cWordBits;
+            Word value = PresenceWord(word) >> shift;
+            if (shift and word + 1 < plane_words)
+                value |= PresenceWord(word + 1) << (cWordBits - shift);
+            out[w] = value & BitMask(0, std::min(cWordBits, ring - w * cWordBits));
+        }
+        return;
+    }
+    CopyBits(out, words, 0, presence.data(), presence.size(), size_t(sector) * ring, ring);
+}
+
+void TileGrid::WriteSector(uint32_t sector, Word const* in) {
+    Own();
+    size_t const begin = size_t(sector) * ring;
+    ClearRange(presence, begin, begin + ring);
+    CopyBits(presence.data(), presence.size(), begin, in, WordCount(ring), 0, ring);
+}
+
+void TileGrid::InsertSectors(uint32_t at, uint32_t count) {
+    Own();
+    size_t const split = size_t(at) * ring, tail = size_t(sectors - at) * ring;
+    sectors += count;
+    std::vector<Word> grown(WordCount(Size()), 0);
+    CopyBits(grown, 0, presence, 0, split);
+    CopyBits(grown, split + size_t(count) * ring, presence, split, tail);
+    presence.swap(grown);
+}
+
+void TileGrid::EraseSectors(uint32_t at, uint32_t count) {
+    Own();
+    size_t const split = size_t(at) * ring, tail = size_t(sectors - at - count) * ring;
+    sectors -= count;
+    std::vector<Word> shrunk(WordCount(Size()), 0);
+    CopyBits(shrunk, 0, presence, 0, split);
+    CopyBits(shrunk, split, presence, split + size_t(count) * ring, tail);
+    presence.swap(shrunk);
+}
+
+void TileGrid::SplitSectors(uint32_t at, TileGrid& tail) {
+    size_t const split = size_t(at) * ring, count = Size() - split;
+    tail.ring = ring;
+    tail.sectors = sectors - at;
+    if (borrowed and split % 8 == 0) {
+        // Both halves keep referencing the external buffer
+        tail.borrowed = borrowed + split / 8;
+        tail.presence.clear();
+    } else {
+        Own();
+        tail.borrowed = nullptr;
+        tail.presence.assign(WordCount(count), 0);
+        CopyBits(tail.presence, 0, presence, split, count);
+    }
+    sectors = at;
+    if (!borrowed) {
+        presence.resize(WordCount(Size()));
+        ClearTail(presence, Size());
+    }
+}
+
+void TileGrid::AppendSectors(TileGrid const& other) {
+    Own();
+    size_t const begin = Size();
+    sectors += other.sectors;
+    presence.resize(WordCount(Size()), 0);
+    // A sector at a time, the other grid may be borrowed
+    std::vector<Word> row(WordCount(ring));
+    for (uint32_t z = 0; z != other.sectors; ++z) {
+        other.ReadSector(z, row.data());
+        CopyBits(presence.data(), presence.size(), begin + size_t(z) * ring, row.data(), row.size(), 0, ring);
+    }
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <bit>
+#include <vector>
+
+// The planes are read as LSB-first bytes, the bit order of the level file
+static_assert(std::endian::native == std::endian::little);
+
+// Slot storage of a segment, as a bitplane of floor presence (the editor cursor isn't stored here)
+// Slot s of sector z is bit (z * ring + s) of the plane, stored LSB first in 64-bit words
+// Bits past the last slot are always 0
+struct TileGrid {
+    using Word = uint64_t;
+    static constexpr size_t cWordBits = 64;
+
+    // Fills the grid with sectors of ring slots each
+    void Reset(uint32_t ring, uint32_t sectors, bool present);
+    // References the presence bits (LSB first) of an external buffer instead of copying them
+    // The buffer must stay valid until the grid is modified or reset
+    void Borrow(uint32_t ring, uint32_t sectors, uint8_t const* bits);
+    // Copies the presence bits (LSB first)
+    void Assign(uint32_t ring, uint32_t sectors, uint8_t const* bits);
+    // Packs the presence bits from one byte per slot (bit 0)
+    void AssignBytes(uint32_t ring, uint32_t sectors, uint8_t const* values);
+    // Releases the memory
+    void Clear();
+
+    uint32_t Ring() const { return ring; }
+    uint32_t Sectors() const { return sectors; }
+    size_t Size() const { return size_t(ring) * sectors; }
+    // Length of a plane in bytes
+    size_t PlaneBytes() const { return (Size() + 7) / 8; }
+
+    uint8_t const* PresenceBytes() const {
+        return borrowed ? borrowed : reinterpret_cast<uint8_t const*>(presence.data());
+    }
+
+    bool Present(size_t slot) const { return (PresenceBytes()[slot / 8] >> (slot & 7)) & 1; }
+
+    void TogglePresent(size_t slot);
+
+    // Copies the presence bits of a sector into (ring + 63) / 64 words, bits past the ring are 0
+    void ReadSector(uint32_t sector, Word* out) const;
+    // Replaces the presence bits of a sector, in the layout of ReadSector
+    void WriteSector(uint32_t sector, Word const* in);
+
+    // Inserts count empty sectors before sector at
+    void InsertSectors(uint32_t at, uint32_t count);
+    void EraseSectors(uint32_t at, uint32_t count);
+    // Moves sectors [at, Sectors()) into tail (replacing its contents), this grid keeps the first at sectors
+    // Borrowed presence bits stay borrowed by both grids if the split falls on a byte boundary
+    void SplitSectors(uint32_t at, TileGrid& tail);
+    // Appends the sectors of a grid with the same ring
+    void AppendSectors(TileGrid const& other);
+
+    // Calls fn(k, value) for each slot k of a sector in order, value is the presence (the tile palette index)
+    // Reads the plane a word at a time
+    template <typename F>
+    void ForEachSectorSlot(uint32_t sector, F&& fn) const {
+        size_t const begin = size_t(sector) * ring, end = begin + ring;
+        for (size_t slot = begin; slot != end;) {
+            size_t const word = slot / cWordBits;
+            size_t const chunk_end = std::min((word + 1) * cWordBits, end);
+            Word const p = PresenceWord(word) >> (slot % cWordBits);
+            for (size_t bit = 0; slot != chunk_end; ++slot, ++bit)
+                fn(static_cast<uint32_t>(slot - begin), static_cast<uint8_t>((p >> bit) & 1));
+        }
+    }
+
+private:
+    uint32_t ring = 0, sectors = 0;
+    std::vector<Word> presence; // Empty while borrowed
+    uint8_t const* borrowed = nullptr;
+
+    Word PresenceWord(size_t word) const {
+        if (!borrowed)
+            return presence[word];
+        // The borrowed buffer isn't padded to whole words
+        Word value = 0;
+        std::memcpy(&value, borrowed + word * sizeof(Word), std::min(sizeof(Word), PlaneBytes() - word * sizeof(Word)));
+        return value;
+    }
+    // Copies the borrowed presence bits before modifying them
+    void Own();
+};
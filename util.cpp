@@ -2,6 +2,11 @@
 
 #include <fstream>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 FileContents ReadFile(char const* fname, bool binary) {
     auto file = std::ifstream(fname, std::ios::in | (binary ? std::ios::binary : std::ios::openmode()));
     file.seekg(0, std::ios::end);
@@ -17,3 +22,33 @@ void WriteFile(char const* fname, unsigned char const* data, size_t size, bool b
     auto file = std::ofstream(fname, std::ios::out | (binary ? std::ios::binary : std::ios::openmode()));
     file.write(reinterpret_cast<char const*>(data), size);
 }
+
+MappedFile::~MappedFile() {
+    if (data)
+        munmap(const_cast<unsigned char*>(data), size);
+}
+
+std::unique_ptr<MappedFile> MapFile(char const* fname) {
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return nullptr;
+    }
+    auto file = std::make_unique<MappedFile>();
+    file->size = st.st_size;
+    // Empty files can't be mapped
+    if (file->size != 0) {
+        void* addr = mmap(nullptr, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            close(fd);
+            return nullptr;
+        }
+        file->data = reinterpret_cast<unsigned char const*>(addr);
+    }
+    // The mapping stays valid after closing
+    close(fd);
+    return file;
+}
@@ -7,5 +7,18 @@ struct FileContents {
     size_t size;
 };
 
+// Read-only memory mapping of a whole file
+struct MappedFile {
+    unsigned char const* data = nullptr;
+    size_t size = 0;
+
+    MappedFile() = default;
+    MappedFile(MappedFile const&) = delete;
+    MappedFile& operator=(MappedFile const&) = delete;
+    ~MappedFile();
+};
+
 FileContents ReadFile(char const* fname, bool binary = true);
 void WriteFile(char const* fname, unsigned char const* data, size_t size, bool binary = true);
+// Returns null on failure (errno is set)
+std::unique_ptr<MappedFile> MapFile(char const* fname);
@@ -0,0 +1,14 @@
+#!/bin/sh
+set -e
+
+# Headless level validation, no window or GL context needed
+# Usage: ./validate.sh [-s speed] level.dat...
+
+# Links the level code, so GLEW is needed like in compile.sh (no GL calls are made)
+if [ ! -f glew.o ]; then
+    echo 'Compiling GLEW'
+    cc -c -o glew.o -I "$GLEW_PATH/include" "$GLEW_PATH/src/glew.c" -DGLEW_STATIC
+fi
+c++ -DGLEW_STATIC -std=c++20 -O2 -pthread -o validate_level glew.o validate_level.cpp \
+    run.cpp render_mesh.cpp util.cpp tile_grid.cpp bitops.cpp thread_pool.cpp profiler.cpp -lGL
+./validate_level "$@"
@@ -0,0 +1,106 @@
+// Headless level validator: plays levels like the game mode does and reports where the player falls through (see validate.sh)
+// Usage: validate_level [-s speed] level.dat...
+// Exits with 1 if a level can't be loaded or the player falls somewhere
+
+#include "run.hpp"
+#include "thread_pool.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// Level sectors [begin, end) without a tile under the player
+struct Gap {
+    uint32_t begin, end;
+    double time; // Seconds of play until the player reaches the gap
+};
+
+struct LevelReport {
+    bool loaded = false;
+    // The player stopped before the end, the step is below the float precision of its Z
+    bool stuck = false;
+    uint32_t stuck_sector = 0;
+    uint32_t sectors = 0;
+    uint64_t steps = 0;
+    std::vector<Gap> gaps;
+};
+
+static LevelReport ValidateLevel(char const* fname, float speed) {
+    LevelReport report;
+    LevelInfo level;
+    if (!ReadLevelFromFile(level, fname))
+        return report;
+    report.loaded = true;
+    report.sectors = level.sector_offsets.back();
+
+    // Same steps as game_update, so the checked positions are the ones the game would reach
+    PlayerSim sim {0.f, 0.f, speed};
+    SectorLocation loc {0, 0, 0};
+    bool falling = false;
+    while (LocateSector(level, sim.curZ, loc, loc.segment)) {
+        if (IsPlayerSupported(level, loc)) {
+            falling = false;
+        } else if (falling) {
+            report.gaps.back().end = loc.level_sector + 1;
+        } else {
+            report.gaps.push_back({loc.level_sector, loc.level_sector + 1, report.steps * cSimStep});
+            falling = true;
+        }
+        StepPlayer(sim);
+        ++report.steps;
+        if (sim.curZ == sim.prevZ) {
+            report.stuck = true;
+            report.stuck_sector = loc.level_sector;
+            break;
+        }
+    }
+    return report;
+}
+
+int main(int argc, char** argv) {
+    float speed = cPlayerSpeed;
+    std::vector<char const*> files;
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "-s") and i + 1 < argc)
+            speed = std::atof(argv[++i]);
+        else
+            files.push_back(argv[i]);
+    }
+    if (files.empty() or !(speed > 0.f)) {
+        std::fprintf(stderr, "Usage: %s [-s speed] level.dat...\n", argv[0]);
+        return 2;
+    }
+
+    // Levels are independent, each one is loaded and played on a single thread
+    std::vector<LevelReport> reports(files.size());
+    auto const start = std::chrono::steady_clock::now();
+    ParallelFor(files.size(), [&](size_t idx) { reports[idx] = ValidateLevel(files[idx], speed); });
+    double const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    size_t failed = 0;
+    uint64_t steps = 0;
+    for (size_t idx = 0; idx != files.size(); ++idx) {
+        LevelReport const& report = reports[idx];
+        steps += report.steps;
+        if (!report.loaded) {
+            // The reason was printed by ReadLevelFromFile
+            std::printf("%s: not loaded\n", files[idx]);
+            ++failed;
+            continue;
+        }
+        if (report.gaps.empty() and !report.stuck) {
+            std::printf("%s: ok, %u sectors, %.2f s\n", files[idx], report.sectors, report.steps * cSimStep);
+            continue;
+        }
+        ++failed;
+        for (Gap const& gap : report.gaps)
+            std::printf("%s: falls at sectors [%u, %u) after %.2f s\n", files[idx], gap.begin, gap.end, gap.time);
+        if (report.stuck)
+            std::printf("%s: stuck at sector %u after %.2f s\n", files[idx], report.stuck_sector, report.steps * cSimStep);
+    }
+    std::printf("%zu levels, %zu failed, %llu steps in %.3f s (%.0f steps/s, %zu threads)\n",
+        files.size(), failed, static_cast<unsigned long long>(steps), seconds, steps / seconds, WorkerCount());
+    return failed ? 1 : 0;
+}
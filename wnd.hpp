@@ -2,6 +2,8 @@
 
 #include <GL/gl.h>
 
+#include <span>
+
 #include "event.hpp"
 
 struct InitParams {
@@ -15,7 +17,10 @@ struct InitParams {
 struct WindowState;
 
 extern WindowState* init_window(InitParams const& init);
+// The GL context is current on one thread at a time; release it before making it current on another thread
 extern void make_current(WindowState* window);
+extern void release_current(WindowState* window);
 extern void window_finish(WindowState* window);
 extern void window_swap(WindowState* window);
-extern bool window_pop_event(WindowState* window, WinEvent& event);
+// Moves the pending events into events (as many as fit), returns their count; 0 when there are none left
+extern size_t window_pop_events(WindowState* window, std::span<WinEvent> events);
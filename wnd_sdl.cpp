@@ -1,13 +1,134 @@
 #include <SDL2/SDL.h>
 
+#include <algorithm>
+#include <iterator>
+
 #include "wnd.hpp"
 
 struct WindowState {
     SDL_Window* window;
     SDL_GLContext gl_context;
-    SDL_Event event;
+    // Keys of each scancode, see BuildKeyTables
+    PhysicalKey phys_keys[SDL_NUM_SCANCODES];
+    LogicalKey logical_keys[SDL_NUM_SCANCODES];
+    // Events are taken from the SDL queue in batches of this size
+    SDL_Event events[64];
 };
 
+#define COMMON_KEYS \
+    MK(1, N1) \
+    MK(2, N2) \
+    MK(3, N3) \
+    MK(4, N4) \
+    MK(5, N5) \
+    MK(6, N6) \
+    MK(7, N7) \
+    MK(8, N8) \
+    MK(9, N9) \
+    MK(0, N0) \
+    MK(RETURN, Return) \
+    MK(ESCAPE, Escape) \
+    MK(BACKSPACE, Backspace) \
+    MK(TAB, Tab) \
+    MK(SPACE, Space) \
+    MK(LEFT, ArrowLeft) \
+    MK(RIGHT, ArrowRight) \
+    MK(UP, ArrowUp) \
+    MK(DOWN, ArrowDown) \
+    MK(PAGEUP, PageUp) \
+    MK(PAGEDOWN, PageDown) \
+    MK(INSERT, Insert) \
+    MK(DELETE, Delete) \
+    // End
+
+static PhysicalKey GetPhysicalKey(SDL_Scancode scancode) {
+    #define MK(sdl, enum) case SDL_SCANCODE_##sdl: return PhysicalKey::enum;
+    switch (scancode) {
+        MK(A, A)
+        MK(B, B)
+        MK(C, C)
+        MK(D, D)
+        MK(E, E)
+        MK(F, F)
+        MK(G, G)
+        MK(H, H)
+        MK(I, I)
+        MK(J, J)
+        MK(K, K)
+        MK(L, L)
+        MK(M, M)
+        MK(N, N)
+        MK(O, O)
+        MK(P, P)
+        MK(Q, Q)
+        MK(R, R)
+        MK(S, S)
+        MK(T, T)
+        MK(U, U)
+        MK(V, V)
+        MK(W, W)
+        MK(X, X)
+        MK(Y, Y)
+        MK(Z, Z)
+        COMMON_KEYS
+        MK(MINUS, Minus)
+        MK(EQUALS, Equals)
+        default:
+            return PhysicalKey::Unknown;
+    }
+    #undef MK
+}
+
+static LogicalKey GetLogicalKey(SDL_Keycode sym) {
+    #define MK(sdl, enum) case SDLK_##sdl: return LogicalKey::enum;
+    switch (sym) {
+        MK(a, A)
+        MK(b, B)
+        MK(c, C)
+        MK(d, D)
+        MK(e, E)
+        MK(f, F)
+        MK(g, G)
+        MK(h, H)
+        MK(i, I)
+        MK(j, J)
+        MK(k, K)
+        MK(l, L)
+        MK(m, M)
+        MK(n, N)
+        MK(o, O)
+        MK(p, P)
+        MK(q, Q)
+        MK(r, R)
+        MK(s, S)
+        MK(t, T)
+        MK(u, U)
+        MK(v, V)
+        MK(w, W)
+        MK(x, X)
+        MK(y, Y)
+        MK(z, Z)
+        COMMON_KEYS
+        MK(PLUS, Plus)
+        MK(MINUS, Minus)
+        MK(EQUALS, Equals)
+        default:
+            return LogicalKey::Unknown;
+    }
+    #undef MK
+}
+
+#undef COMMON_KEYS
+
+// Translates every scancode up front, the logical keys again when the keyboard layout changes
+static void BuildKeyTables(WindowState& window) {
+    for (int sc = 0; sc != SDL_NUM_SCANCODES; ++sc) {
+        SDL_Scancode const scancode = static_cast<SDL_Scancode>(sc);
+        window.phys_keys[sc] = GetPhysicalKey(scancode);
+        window.logical_keys[sc] = GetLogicalKey(SDL_GetKeyFromScancode(scancode));
+    }
+}
+
 WindowState* init_window(InitParams const& init) {
     SDL_Init(SDL_INIT_VIDEO);
 
@@ -19,16 +140,22 @@ WindowState* init_window(InitParams const& init) {
     SDL_Window* wnd = SDL_CreateWindow(init.title, 0, 0, init.init_width, init.init_height, SDL_WINDOW_OPENGL);
     SDL_GLContext gctx = SDL_GL_CreateContext(wnd);
 
-    return new WindowState {
+    WindowState* window = new WindowState {
         .window = wnd,
         .gl_context = gctx,
     };
+    BuildKeyTables(*window);
+    return window;
 }
 
 void make_current(WindowState* window) {
     SDL_GL_MakeCurrent(window->window, window->gl_context);
 }
 
+void release_current(WindowState* window) {
+    SDL_GL_MakeCurrent(window->window, nullptr);
+}
+
 void window_finish(WindowState* window) {
     SDL_GL_DeleteContext(window->gl_context);
     SDL_DestroyWindow(window->window);
@@ -41,121 +168,41 @@ void window_swap(WindowState* window) {
     SDL_GL_SwapWindow(window->window);
 }
 
-bool window_pop_event(WindowState* window, WinEvent& event) {
-    next:
-    if (!SDL_PollEvent(&window->event))
-        return false;
-    switch (window->event.type) {
-        case SDL_QUIT:
-            event.type = EventType::Quit;
-            break;
-        case SDL_KEYDOWN:
-            event.type = EventType::KeyDown;
-            break;
-        case SDL_KEYUP:
-            event.type = EventType::KeyUp;
-            break;
-        default:
-            goto next;
-    }
-    if (event.type == EventType::KeyDown or event.type == EventType::KeyUp) {
-        #define COMMON_KEYS \
-            MK(1, N1) \
-            MK(2, N2) \
-            MK(3, N3) \
-            MK(4, N4) \
-            MK(5, N5) \
-            MK(6, N6) \
-            MK(7, N7) \
-            MK(8, N8) \
-            MK(9, N9) \
-            MK(0, N0) \
-            MK(RETURN, Return) \
-            MK(ESCAPE, Escape) \
-            MK(BACKSPACE, Backspace) \
-            MK(TAB, Tab) \
-            MK(SPACE, Space) \
-            MK(LEFT, ArrowLeft) \
-            MK(RIGHT, ArrowRight) \
-            MK(UP, ArrowUp) \
-            MK(DOWN, ArrowDown) \
-            MK(PAGEUP, PageUp) \
-            MK(PAGEDOWN, PageDown) \
-            MK(INSERT, Insert) \
-            MK(DELETE, Delete) \
-            // End
-        // Map key
-        #define MK(sdl, enum) case SDL_SCANCODE_##sdl: event.key.pkey = PhysicalKey::enum; break;
-        switch (window->event.key.keysym.scancode) {
-            MK(A, A)
-            MK(B, B)
-            MK(C, C)
-            MK(D, D)
-            MK(E, E)
-            MK(F, F)
-            MK(G, G)
-            MK(H, H)
-            MK(I, I)
-            MK(J, J)
-            MK(K, K)
-            MK(L, L)
-            MK(M, M)
-            MK(N, N)
-            MK(O, O)
-            MK(P, P)
-            MK(Q, Q)
-            MK(R, R)
-            MK(S, S)
-            MK(T, T)
-            MK(U, U)
-            MK(V, V)
-            MK(W, W)
-            MK(X, X)
-            MK(Y, Y)
-            MK(Z, Z)
-            COMMON_KEYS
-            MK(MINUS, Minus)
-            MK(EQUALS, Equals)
-            default:
-                event.key.pkey = PhysicalKey::Unknown;
+size_t window_pop_events(WindowState* window, std::span<WinEvent> events) {
+    // A single pump for the whole batch (SDL_PollEvent pumps on every call)
+    SDL_PumpEvents();
+    // The SDL timestamps are SDL_GetTicks milliseconds
+    int64_t const now = EventTimeNow();
+    uint32_t const ticks = SDL_GetTicks();
+    size_t count = 0;
+    while (count != events.size()) {
+        // Every SDL event taken produces at most one of ours, so they always fit
+        int const max = static_cast<int>(std::min(std::size(window->events), events.size() - count));
+        int const taken = SDL_PeepEvents(window->events, max, SDL_GETEVENT, SDL_FIRSTEVENT, SDL_LASTEVENT);
+        for (int idx = 0; idx < taken; ++idx) {
+            SDL_Event const& sdl_event = window->events[idx];
+            WinEvent& event = events[count];
+            switch (sdl_event.type) {
+                case SDL_QUIT:
+                    event.type = EventType::Quit;
+                    break;
+                case SDL_KEYDOWN:
+                case SDL_KEYUP:
+                    event.type = sdl_event.type == SDL_KEYDOWN ? EventType::KeyDown : EventType::KeyUp;
+                    event.key.pkey = window->phys_keys[sdl_event.key.keysym.scancode];
+                    event.key.lkey = window->logical_keys[sdl_event.key.keysym.scancode];
+                    break;
+                case SDL_KEYMAPCHANGED:
+                    BuildKeyTables(*window);
+                    continue;
+                default:
+                    continue;
+            }
+            event.common.time = now - int64_t(ticks - sdl_event.common.timestamp) * 1000000;
+            ++count;
         }
-        #undef MK
-        #define MK(sdl, enum) case SDLK_##sdl: event.key.lkey = LogicalKey::enum; break;
-        switch (window->event.key.keysym.sym) {
-            MK(a, A)
-            MK(b, B)
-            MK(c, C)
-            MK(d, D)
-            MK(e, E)
-            MK(f, F)
-            MK(g, G)
-            MK(h, H)
-            MK(i, I)
-            MK(j, J)
-            MK(k, K)
-            MK(l, L)
-            MK(m, M)
-            MK(n, N)
-            MK(o, O)
-            MK(p, P)
-            MK(q, Q)
-            MK(r, R)
-            MK(s, S)
-            MK(t, T)
-            MK(u, U)
-            MK(v, V)
-            MK(w, W)
-            MK(x, X)
-            MK(y, Y)
-            MK(z, Z)
-            COMMON_KEYS
-            MK(PLUS, Plus)
-            MK(MINUS, Minus)
-            MK(EQUALS, Equals)
-            default:
-                event.key.lkey = LogicalKey::Unknown;
-        }
-        #undef MK
+        if (taken < max)
+            break;
     }
-    return true;
+    return count;
 }
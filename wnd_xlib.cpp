@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
 #include <memory>
@@ -105,9 +106,12 @@ static struct PhysicalKeyNameMapping {
     K("DELE", Delete)
 };
 
-struct PhysicalKeyMap {
+// Keys of each keycode (from XkbMinLegalKeyCode), translated once by BuildKeyTables
+struct KeyMap {
     // Unknown is first, so it will init to Unknown
-    PhysicalKey map[XkbMaxKeyCount] = {};
+    PhysicalKey phys[XkbMaxKeyCount] = {};
+    // Without and with Shift, the other modifiers don't change the keys we map
+    LogicalKey logical[2][XkbMaxKeyCount] = {};
 };
 
 
@@ -116,12 +120,70 @@ struct WindowState {
     DisplayAtomList atoms;
     Window window;
     XkbDescPtr xkb_desc;
-    PhysicalKeyMap phys_keys;
+    KeyMap keys;
     GLXContext gl_ctx;
     XEvent event;
+    // Server time of the last key event, extended past the 32-bit wraparound (ms)
+    int64_t server_ms = -1;
+    Time last_server_time;
+    // Local time of server time 0 (see LocalEventTime)
+    int64_t server_offset;
 };
 
+static LogicalKey GetLogicalKey(KeySym sym) {
+    #define SYM(xname, lname) case XK_##xname: return LogicalKey::lname;
+    #define AL(up, low) case XK_##up: case XK_##low: return LogicalKey::up;
+    #define BI(name) case XK_##name: return LogicalKey::name;
+    #define AR(name) case XK_##name: return LogicalKey::Arrow##name;
+    switch (sym) {
+        // TODO: Handle this better
+        AL(A, a) AL(B, b) AL(C, c) AL(D, d) AL(E, e) AL(F, f) AL(G, g) AL(H, h) AL(I, i) AL(J, j) AL(K, k) AL(L, l) AL(M, m) AL(N, n) AL(O, o) AL(P, p) AL(Q, q) AL(R, r) AL(S, s) AL(T, t) AL(U, u) AL(V, v) AL(W, w) AL(X, x) AL(Y, y) AL(Z, z)
+        SYM(1, N1) SYM(2, N2) SYM(3, N3) SYM(4, N4) SYM(5, N5) SYM(6, N6) SYM(7, N7) SYM(8, N8) SYM(9, N9) SYM(0, N0)
+        BI(Return)
+        BI(Escape)
+        SYM(BackSpace, Backspace)
+        BI(Tab)
+        SYM(space, Space)
+        AR(Left)
+        AR(Right)
+        AR(Up)
+        AR(Down)
+        SYM(plus, Plus)
+        SYM(minus, Minus)
+        SYM(equal, Equals)
+        SYM(Prior, PageUp)
+        SYM(Next, PageDown)
+        SYM(Insert, Insert)
+        SYM(Delete, Delete)
+        default:
+            return LogicalKey::Unknown;
+    }
+    #undef SYM
+    #undef AL
+    #undef BI
+    #undef AR
+}
+
+// Translates every keycode of the keyboard up front, so events are mapped with a table lookup
+static void BuildKeyTables(WindowState& ws) {
+    for (uint32_t kc = ws.xkb_desc->min_key_code; kc <= ws.xkb_desc->max_key_code; ++kc) {
+        for (auto const& map : sPhysKeys) {
+            if (std::strncmp(map.name, ws.xkb_desc->names->keys[kc].name, XkbKeyNameLength) == 0) {
+                ws.keys.phys[kc - XkbMinLegalKeyCode] = map.key;
+                break;
+            }
+        }
+        for (uint32_t shift = 0; shift != 2; ++shift) {
+            KeySym sym = NoSymbol;
+            XkbTranslateKeyCode(ws.xkb_desc, kc, shift ? ShiftMask : 0, /* ret_mods */ nullptr, &sym);
+            ws.keys.logical[shift][kc - XkbMinLegalKeyCode] = GetLogicalKey(sym);
+        }
+    }
+}
+
 WindowState* init_window(InitParams const& init) {
+    // Events are read on the main thread while the render thread swaps buffers
+    XInitThreads();
     Display* dpy = XOpenDisplay(nullptr);
     if (!dpy) {
         std::fputs("Couldn't open X display\n", stderr);
@@ -168,14 +230,7 @@ WindowState* init_window(InitParams const& init) {
     ws->xkb_desc = XkbGetMap(dpy, XkbAllMapComponentsMask, XkbUseCoreKbd);
     XkbGetNames(dpy, XkbKeyNamesMask, ws->xkb_desc);
 
-    for (uint32_t kc = ws->xkb_desc->min_key_code; kc <= ws->xkb_desc->max_key_code; ++kc) {
-        for (auto const& map : sPhysKeys) {
-            if (std::strncmp(map.name, ws->xkb_desc->names->keys[kc].name, XkbKeyNameLength) == 0) {
-                ws->phys_keys.map[kc - XkbMinLegalKeyCode] = map.key;
-                break;
-            }
-        }
-    }
+    BuildKeyTables(*ws);
 
     ws->gl_ctx = glXCreateContext(dpy, vi, nullptr, GL_TRUE);
     return ws.release();
@@ -185,6 +240,10 @@ void make_current(WindowState* window) {
     glXMakeCurrent(window->dpy, window->window, window->gl_ctx);
 }
 
+void release_current(WindowState* window) {
+    glXMakeCurrent(window->dpy, None, nullptr);
+}
+
 void window_finish(WindowState* window_) {
     std::unique_ptr<WindowState> window(window_);
     glXMakeCurrent(window->dpy, None, nullptr);
@@ -201,92 +260,74 @@ void window_swap(WindowState* window) {
 
 static void get_x_key_codes(WindowState const& window, decltype(WinEvent::key)& key, uint32_t scancode, uint32_t mods) {
     if (scancode <= XkbMaxLegalKeyCode and scancode >= XkbMinLegalKeyCode) {
-        key.pkey = window.phys_keys.map[scancode - XkbMinLegalKeyCode];
+        key.pkey = window.keys.phys[scancode - XkbMinLegalKeyCode];
+        key.lkey = window.keys.logical[(mods & ShiftMask) != 0][scancode - XkbMinLegalKeyCode];
     } else {
         key.pkey = PhysicalKey::Unknown;
+        key.lkey = LogicalKey::Unknown;
     }
+}
 
-    KeySym sym = NoSymbol;
-    XkbTranslateKeyCode(window.xkb_desc, scancode, mods, /* ret_mods */ nullptr, &sym);
-    #define SYM(xname, lname) case XK_##xname: key.lkey = LogicalKey::lname; break;
-    #define AL(up, low) case XK_##up: case XK_##low: key.lkey = LogicalKey::up; break;
-    #define BI(name) case XK_##name: key.lkey = LogicalKey::name; break;
-    #define AR(name) case XK_##name: key.lkey = LogicalKey::Arrow##name; break;
-    switch (sym) {
-        // TODO: Handle this better
-        AL(A, a) AL(B, b) AL(C, c) AL(D, d) AL(E, e) AL(F, f) AL(G, g) AL(H, h) AL(I, i) AL(J, j) AL(K, k) AL(L, l) AL(M, m) AL(N, n) AL(O, o) AL(P, p) AL(Q, q) AL(R, r) AL(S, s) AL(T, t) AL(U, u) AL(V, v) AL(W, w) AL(X, x) AL(Y, y) AL(Z, z)
-        SYM(1, N1) SYM(2, N2) SYM(3, N3) SYM(4, N4) SYM(5, N5) SYM(6, N6) SYM(7, N7) SYM(8, N8) SYM(9, N9) SYM(0, N0)
-        BI(Return)
-        BI(Escape)
-        SYM(BackSpace, Backspace)
-        BI(Tab)
-        SYM(space, Space)
-        AR(Left)
-        AR(Right)
-        AR(Up)
-        AR(Down)
-        SYM(plus, Plus)
-        SYM(minus, Minus)
-        SYM(equal, Equals)
-        SYM(Prior, PageUp)
-        SYM(Next, PageDown)
-        SYM(Insert, Insert)
-        SYM(Delete, Delete)
-        default:
-            key.lkey = LogicalKey::Unknown;
-            break;
+// Maps a server timestamp (ms) to the event clock
+// The server clock's origin is unknown, the event that took the shortest time to arrive is taken as delivered
+// immediately (a local server uses the same monotonic clock, so the offset settles within a few events)
+static int64_t LocalEventTime(WindowState& window, Time server_time, int64_t now) {
+    if (window.server_ms < 0) {
+        window.server_ms = static_cast<uint32_t>(server_time);
+        window.server_offset = now - window.server_ms * 1000000;
+    } else {
+        window.server_ms += static_cast<int32_t>(static_cast<uint32_t>(server_time) - static_cast<uint32_t>(window.last_server_time));
+        window.server_offset = std::min(window.server_offset, now - window.server_ms * 1000000);
     }
-    #undef SYM
-    #undef AL
-    #undef BI
-    #undef AR
+    window.last_server_time = server_time;
+    return window.server_ms * 1000000 + window.server_offset;
 }
 
-bool window_pop_event(WindowState* window, WinEvent& event) {
-    retry:
-    #if 0
-    if (XPending(window->dpy) <= 0) {
-        return false;
-    }
-    XNextEvent(window->dpy, &window->event);
-    #else
-    if (!XCheckWindowEvent(window->dpy, window->window, ExposureMask | KeyPressMask | KeyReleaseMask, &window->event) and !XCheckTypedEvent(window->dpy, ClientMessage, &window->event)) {
-        return false;
-    }
-    #endif
-    switch (window->event.type) {
-        case ClientMessage:
-            if (window->event.xclient.message_type == window->atoms[DisplayAtom::WM_Protocols]) {
-                if (static_cast<Atom>(window->event.xclient.data.l[0]) == window->atoms[DisplayAtom::WM_DeleteWindow]) {
-                    event.type = EventType::Quit;
-                    break;
-                }
-            }
-            goto retry;
-        case KeyPress:
-            event.type = EventType::KeyDown;
-            get_x_key_codes(*window, event.key, window->event.xkey.keycode, window->event.xkey.state);
-            break;
-        case KeyRelease:
-            event.type = EventType::KeyUp;
-            get_x_key_codes(*window, event.key, window->event.xkey.keycode, window->event.xkey.state);
-            break;
-        default: goto retry;
-    }
-    #if 0
-    switch (event.type) {
-        case EventType::Quit:
-            std::puts("[X11 Debug] Event: Quit");
-            break;
-        case EventType::KeyDown:
-            std::printf("[X11 Debug] Event: KeyDown: logical=%s physical=%s\n", LogicalKeyAsString(event.key.lkey), PhysicalKeyAsString(event.key.pkey));
-            break;
-        case EventType::KeyUp:
-            std::printf("[X11 Debug] Event: KeyUp: logical=%s physical=%s\n", LogicalKeyAsString(event.key.lkey), PhysicalKeyAsString(event.key.pkey));
-            break;
+size_t window_pop_events(WindowState* window, std::span<WinEvent> events) {
+    // Reads what the connection has once, then takes the queued events without further checks
+    // (XCheckWindowEvent would scan the whole queue for every event); there is a single window
+    int queued = XEventsQueued(window->dpy, QueuedAfterReading);
+    int64_t const now = EventTimeNow();
+    size_t count = 0;
+    while (queued-- > 0 and count != events.size()) {
+        XNextEvent(window->dpy, &window->event);
+        WinEvent& event = events[count];
+        switch (window->event.type) {
+            case ClientMessage:
+                if (window->event.xclient.message_type != window->atoms[DisplayAtom::WM_Protocols]
+                    or static_cast<Atom>(window->event.xclient.data.l[0]) != window->atoms[DisplayAtom::WM_DeleteWindow])
+                    continue;
+                event.type = EventType::Quit;
+                event.common.time = now;
+                break;
+            case KeyPress:
+                event.type = EventType::KeyDown;
+                get_x_key_codes(*window, event.key, window->event.xkey.keycode, window->event.xkey.state);
+                event.common.time = LocalEventTime(*window, window->event.xkey.time, now);
+                break;
+            case KeyRelease:
+                event.type = EventType::KeyUp;
+                get_x_key_codes(*window, event.key, window->event.xkey.keycode, window->event.xkey.state);
+                event.common.time = LocalEventTime(*window, window->event.xkey.time, now);
+                break;
+            default: continue;
+        }
+        #if 0
+        switch (event.type) {
+            case EventType::Quit:
+                std::puts("[X11 Debug] Event: Quit");
+                break;
+            case EventType::KeyDown:
+                std::printf("[X11 Debug] Event: KeyDown: logical=%s physical=%s\n", LogicalKeyAsString(event.key.lkey), PhysicalKeyAsString(event.key.pkey));
+                break;
+            case EventType::KeyUp:
+                std::printf("[X11 Debug] Event: KeyUp: logical=%s physical=%s\n", LogicalKeyAsString(event.key.lkey), PhysicalKeyAsString(event.key.pkey));
+                break;
+        }
+        #endif
+        ++count;
     }
-    #endif
-    return true;
+    return count;
 }
 
 